@@ -1,149 +1,1988 @@
 #define _POSIX_C_SOURCE 200102L
 #define _GNU_SOURCE
+#include "clientlog.h"
+#include "codec.h"
 #include <arpa/inet.h>
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <netinet/in.h>
+#include <poll.h>
 #include <pthread.h>
+#include <signal.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+#include <time.h>
 #include <unistd.h>
+#include <zlib.h>
 
 int convert(uint8_t *buf, ssize_t buf_size, char *str, ssize_t str_size) {
   if (buf == NULL || str == NULL || buf_size <= 0 ||
       str_size < (buf_size * 2 + 1)) {
     return -1;
   }
-  for (int i = 0; i < buf_size; i++)
-    sprintf(str + i * 2, "%02X", buf[i]);
+  hex_encode(buf, buf_size, str);
   str[buf_size * 2] = '\0';
   return 0;
 }
 
+// Protocol extensions: sequenced broadcast with NACK-based repair (used for
+// the multicast fanout) and resume after a reconnect.
+#define MSG_NACK 2
+#define MSG_RETRANSMIT 3
+#define MSG_ANNOUNCE 4
+#define MSG_GAP 5
+#define MSG_RESUME 6
+#define MSG_HELLO 7
+#define MAX_FRAME_SIZE 1024
+#define REORDER_WINDOW 1024
+#define RECV_IDLE_TIMEOUT_MS 3000
+
+#define RECONNECT_BASE_MS 100
+#define RECONNECT_MAX_MS 10000
+#define DEFAULT_RECONNECTS 8
+
+#define RING_INITIAL_SIZE (64 * 1024)
+#define RING_MIN_READ 4096
+
+// Receive ring mapped twice back to back over one memfd, so the buffered
+// bytes are always contiguous at base + head and frames parse in place.
+typedef struct {
+  uint8_t *base;
+  size_t cap;
+  size_t head;
+  size_t len;
+} RingBuffer;
+
+static int ring_init(RingBuffer *rb, size_t cap) {
+  long page = sysconf(_SC_PAGESIZE);
+  cap = (cap + page - 1) / page * page;
+  int fd = memfd_create("client-ring", MFD_CLOEXEC);
+  if (fd < 0)
+    return -1;
+  if (ftruncate(fd, cap) < 0) {
+    close(fd);
+    return -1;
+  }
+  uint8_t *base =
+      mmap(NULL, cap * 2, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (base == MAP_FAILED) {
+    close(fd);
+    return -1;
+  }
+  if (mmap(base, cap, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) ==
+          MAP_FAILED ||
+      mmap(base + cap, cap, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd,
+           0) == MAP_FAILED) {
+    munmap(base, cap * 2);
+    close(fd);
+    return -1;
+  }
+  close(fd);
+  rb->base = base;
+  rb->cap = cap;
+  rb->head = 0;
+  rb->len = 0;
+  return 0;
+}
+
+static void ring_destroy(RingBuffer *rb) {
+  if (rb->base)
+    munmap(rb->base, rb->cap * 2);
+  rb->base = NULL;
+}
+
+static inline uint8_t *ring_data(RingBuffer *rb) { return rb->base + rb->head; }
+
+static inline uint8_t *ring_space(RingBuffer *rb) {
+  return rb->base + (rb->head + rb->len) % rb->cap;
+}
+
+static inline size_t ring_free(RingBuffer *rb) { return rb->cap - rb->len; }
+
+static inline void ring_consume(RingBuffer *rb, size_t n) {
+  rb->head = (rb->head + n) % rb->cap;
+  rb->len -= n;
+}
+
+// Only reached when a single frame outgrows the ring; normal traffic never
+// copies.
+static int ring_grow(RingBuffer *rb) {
+  RingBuffer bigger;
+  if (ring_init(&bigger, rb->cap * 2) < 0)
+    return -1;
+  memcpy(bigger.base, ring_data(rb), rb->len);
+  bigger.len = rb->len;
+  ring_destroy(rb);
+  *rb = bigger;
+  return 0;
+}
+
+#define WRITER_FLUSH_MS 50
+#define WRITER_FLUSH_BYTES (256 * 1024)
+#define WRITER_INITIAL_SIZE (512 * 1024)
+#define WRITER_MAX_CUTS 64
+
+// Double-buffered output for one fd. The receive path appends to the front
+// buffer under a short lock; the writer thread swaps buffers and issues one
+// large write per batch, plus an fdatasync every sync_ms if requested.
+// A producer can mark file boundaries (cuts) in the stream; the writer calls
+// rotate() when it reaches one and carries on with the fd it returns.
+typedef struct {
+  int fd;
+  int sync_ms;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  char *buf[2];
+  size_t len[2];
+  size_t cap[2];
+  int front;
+  int stop;
+  pthread_t tid;
+  uint64_t committed; // stream bytes committed so far
+  uint64_t written;   // stream bytes written so far (writer thread)
+  uint64_t cuts[WRITER_MAX_CUTS];
+  int n_cuts;
+  int (*rotate)(void *arg, int old_fd);
+  void *rotate_arg;
+} BatchWriter;
+
+static void timespec_add_ms(struct timespec *ts, long ms) {
+  ts->tv_sec += ms / 1000;
+  ts->tv_nsec += (ms % 1000) * 1000000L;
+  if (ts->tv_nsec >= 1000000000L) {
+    ts->tv_sec++;
+    ts->tv_nsec -= 1000000000L;
+  }
+}
+
+static int write_all(int fd, const char *data, size_t len) {
+  while (len > 0) {
+    ssize_t w = write(fd, data, len);
+    if (w < 0) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    data += w;
+    len -= w;
+  }
+  return 0;
+}
+
+// Writes one batch, switching files at every cut that falls inside it.
+static void batch_writer_output(BatchWriter *w, const char *data, size_t len) {
+  for (;;) {
+    pthread_mutex_lock(&w->lock);
+    uint64_t cut = w->n_cuts > 0 ? w->cuts[0] : UINT64_MAX;
+    pthread_mutex_unlock(&w->lock);
+    size_t n = cut - w->written < len ? cut - w->written : len;
+    if (n > 0 && write_all(w->fd, data, n) < 0)
+      perror("batch writer write");
+    data += n;
+    len -= n;
+    w->written += n;
+    if (w->written != cut)
+      return;
+
+    pthread_mutex_lock(&w->lock);
+    memmove(w->cuts, w->cuts + 1, --w->n_cuts * sizeof(w->cuts[0]));
+    pthread_mutex_unlock(&w->lock);
+    if (w->sync_ms > 0)
+      fdatasync(w->fd);
+    w->fd = w->rotate(w->rotate_arg, w->fd);
+  }
+}
+
+static void *batch_writer_thread(void *arg) {
+  BatchWriter *w = arg;
+  struct timespec next_flush, next_sync, now;
+  clock_gettime(CLOCK_MONOTONIC, &next_flush);
+  next_sync = next_flush;
+  timespec_add_ms(&next_flush, WRITER_FLUSH_MS);
+  timespec_add_ms(&next_sync, w->sync_ms);
+
+  pthread_mutex_lock(&w->lock);
+  for (;;) {
+    while (!w->stop && w->len[w->front] < WRITER_FLUSH_BYTES) {
+      if (pthread_cond_timedwait(&w->wake, &w->lock, &next_flush) == ETIMEDOUT)
+        break;
+    }
+    int stopping = w->stop;
+    int back = w->front;
+    if (w->len[back] > 0) {
+      w->front ^= 1;
+      pthread_mutex_unlock(&w->lock);
+      batch_writer_output(w, w->buf[back], w->len[back]);
+      w->len[back] = 0;
+      pthread_mutex_lock(&w->lock);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    next_flush = now;
+    timespec_add_ms(&next_flush, WRITER_FLUSH_MS);
+    if (w->sync_ms > 0 &&
+        (stopping || now.tv_sec > next_sync.tv_sec ||
+         (now.tv_sec == next_sync.tv_sec &&
+          now.tv_nsec >= next_sync.tv_nsec))) {
+      pthread_mutex_unlock(&w->lock);
+      fdatasync(w->fd);
+      pthread_mutex_lock(&w->lock);
+      next_sync = now;
+      timespec_add_ms(&next_sync, w->sync_ms);
+    }
+    if (stopping && w->len[w->front] == 0)
+      break;
+  }
+  pthread_mutex_unlock(&w->lock);
+  return NULL;
+}
+
+static int batch_writer_start(BatchWriter *w, int fd, int sync_ms) {
+  memset(w, 0, sizeof(*w));
+  w->fd = fd;
+  w->sync_ms = sync_ms;
+  for (int i = 0; i < 2; i++) {
+    w->cap[i] = WRITER_INITIAL_SIZE;
+    w->buf[i] = malloc(w->cap[i]);
+    if (!w->buf[i])
+      return -1;
+  }
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&w->wake, &attr);
+  pthread_condattr_destroy(&attr);
+  pthread_mutex_init(&w->lock, NULL);
+  return pthread_create(&w->tid, NULL, batch_writer_thread, w) == 0 ? 0 : -1;
+}
+
+// Returns room for at least `max` bytes in the front buffer with the lock
+// held; batch_writer_commit() releases it. The buffer grows instead of
+// blocking when the writer falls behind.
+static char *batch_writer_reserve(BatchWriter *w, size_t max) {
+  pthread_mutex_lock(&w->lock);
+  int f = w->front;
+  if (w->len[f] + max > w->cap[f]) {
+    size_t cap = w->cap[f] * 2;
+    while (w->len[f] + max > cap)
+      cap *= 2;
+    char *grown = realloc(w->buf[f], cap);
+    if (!grown) {
+      pthread_mutex_unlock(&w->lock);
+      return NULL;
+    }
+    w->buf[f] = grown;
+    w->cap[f] = cap;
+  }
+  return w->buf[f] + w->len[f];
+}
+
+static void batch_writer_commit(BatchWriter *w, size_t used) {
+  w->len[w->front] += used;
+  w->committed += used;
+  int wake = w->len[w->front] >= WRITER_FLUSH_BYTES;
+  pthread_mutex_unlock(&w->lock);
+  if (wake)
+    pthread_cond_signal(&w->wake);
+}
+
+static int batch_writer_can_cut(BatchWriter *w) {
+  pthread_mutex_lock(&w->lock);
+  int room = w->rotate && w->n_cuts < WRITER_MAX_CUTS;
+  pthread_mutex_unlock(&w->lock);
+  return room;
+}
+
+// Ends the current file after everything committed so far. Only the single
+// producer cuts, so a successful batch_writer_can_cut() stays true.
+static void batch_writer_cut(BatchWriter *w) {
+  pthread_mutex_lock(&w->lock);
+  w->cuts[w->n_cuts++] = w->committed;
+  pthread_mutex_unlock(&w->lock);
+}
+
+static void batch_writer_stop(BatchWriter *w) {
+  pthread_mutex_lock(&w->lock);
+  w->stop = 1;
+  pthread_cond_signal(&w->wake);
+  pthread_mutex_unlock(&w->lock);
+  pthread_join(w->tid, NULL);
+  free(w->buf[0]);
+  free(w->buf[1]);
+  pthread_cond_destroy(&w->wake);
+  pthread_mutex_destroy(&w->lock);
+}
+
+// Log rotation: the writer thread renames the live log to <path>.<n> at each
+// cut and reopens <path>; a low-priority thread then gzips closed segments
+// and drops the oldest ones beyond `keep`, so neither the receive path nor
+// the writer waits for compression.
+#define COMPRESS_CHUNK (256 * 1024)
+
+typedef struct {
+  const char *path;
+  int level; // gzip level, 0 leaves segments uncompressed
+  int keep;  // closed segments kept, 0 keeps all
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  int closed;    // segments closed by the writer
+  int processed; // segments compressed and pruned
+  int stop;
+  pthread_t tid;
+} LogRotator;
+
+static void segment_path(char *dst, size_t size, const char *path, int n,
+                         const char *suffix) {
+  snprintf(dst, size, "%s.%d%s", path, n, suffix);
+}
+
+static int compress_segment(const char *src, int level) {
+  char dst[PATH_MAX + 8], tmp[PATH_MAX + 8], mode[16];
+  snprintf(dst, sizeof(dst), "%s.gz", src);
+  snprintf(tmp, sizeof(tmp), "%s.gz.tmp", src);
+  snprintf(mode, sizeof(mode), "wb%d", level);
+  int in = open(src, O_RDONLY);
+  if (in < 0)
+    return -1;
+  gzFile out = gzopen(tmp, mode);
+  char *buf = malloc(COMPRESS_CHUNK);
+  int rc = out && buf ? 0 : -1;
+  ssize_t n;
+  while (rc == 0 && (n = read(in, buf, COMPRESS_CHUNK)) != 0) {
+    if (n < 0 || gzwrite(out, buf, n) != n)
+      rc = -1;
+  }
+  if (out && gzclose(out) != Z_OK)
+    rc = -1;
+  free(buf);
+  close(in);
+  if (rc == 0 && rename(tmp, dst) == 0)
+    return unlink(src);
+  unlink(tmp);
+  return -1;
+}
+
+static void *log_rotator_thread(void *arg) {
+  LogRotator *r = arg;
+  setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), 10);
+  pthread_mutex_lock(&r->lock);
+  for (;;) {
+    while (!r->stop && r->processed == r->closed)
+      pthread_cond_wait(&r->wake, &r->lock);
+    if (r->processed == r->closed)
+      break;
+    int n = ++r->processed;
+    pthread_mutex_unlock(&r->lock);
+
+    char seg[PATH_MAX];
+    segment_path(seg, sizeof(seg), r->path, n, "");
+    if (r->level > 0 && compress_segment(seg, r->level) < 0)
+      fprintf(stderr, "failed to compress %s\n", seg);
+    if (r->keep > 0 && n > r->keep) {
+      segment_path(seg, sizeof(seg), r->path, n - r->keep, "");
+      unlink(seg);
+      segment_path(seg, sizeof(seg), r->path, n - r->keep, ".gz");
+      unlink(seg);
+    }
+    pthread_mutex_lock(&r->lock);
+  }
+  pthread_mutex_unlock(&r->lock);
+  return NULL;
+}
+
+// BatchWriter rotate hook, runs on the writer thread.
+static int log_rotator_rotate(void *arg, int old_fd) {
+  LogRotator *r = arg;
+  close(old_fd);
+  pthread_mutex_lock(&r->lock);
+  int n = r->closed + 1;
+  pthread_mutex_unlock(&r->lock);
+  char seg[PATH_MAX];
+  segment_path(seg, sizeof(seg), r->path, n, "");
+  if (rename(r->path, seg) < 0)
+    perror("rotate log");
+  int fd = open(r->path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0)
+    perror("open log file");
+  pthread_mutex_lock(&r->lock);
+  r->closed = n;
+  pthread_cond_signal(&r->wake);
+  pthread_mutex_unlock(&r->lock);
+  return fd;
+}
+
+static int log_rotator_start(LogRotator *r, const char *path, int level,
+                             int keep) {
+  memset(r, 0, sizeof(*r));
+  r->path = path;
+  r->level = level;
+  r->keep = keep;
+  pthread_mutex_init(&r->lock, NULL);
+  pthread_cond_init(&r->wake, NULL);
+  return pthread_create(&r->tid, NULL, log_rotator_thread, r) == 0 ? 0 : -1;
+}
+
+// Finishes the segments already closed; the live log stays uncompressed.
+static void log_rotator_stop(LogRotator *r) {
+  pthread_mutex_lock(&r->lock);
+  r->stop = 1;
+  pthread_cond_signal(&r->wake);
+  pthread_mutex_unlock(&r->lock);
+  pthread_join(r->tid, NULL);
+  pthread_cond_destroy(&r->wake);
+  pthread_mutex_destroy(&r->lock);
+}
+
+// The message log, either the padded text lines also shown on stdout or the
+// indexed binary format from clientlog.h.
+typedef struct {
+  BatchWriter *w;
+  int binary;
+  uint64_t offset; // bytes in the current segment
+  uint64_t last_index;
+  struct clog_chunk chunk;
+  uint64_t rotate_bytes; // start a new segment past this size, 0: never
+  uint64_t rotate_ns;    // or after this long, 0: never
+  uint64_t segment_start_ns;
+} LogSink;
+
+static void log_sink_put(LogSink *sink, const void *data, size_t len) {
+  char *dst = batch_writer_reserve(sink->w, len);
+  if (!dst)
+    return;
+  memcpy(dst, data, len);
+  batch_writer_commit(sink->w, len);
+  sink->offset += len;
+}
+
+static uint64_t coarse_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void log_sink_start_segment(LogSink *sink) {
+  sink->offset = 0;
+  sink->segment_start_ns = coarse_ns();
+  sink->last_index = CLOG_NO_INDEX;
+  if (sink->binary) {
+    log_sink_put(sink, CLOG_MAGIC, CLOG_MAGIC_LEN);
+    clog_chunk_reset(&sink->chunk, sink->offset, sink->last_index);
+  }
+}
+
+static void log_sink_init(LogSink *sink, BatchWriter *w, int binary,
+                          uint64_t rotate_bytes, int rotate_secs) {
+  memset(sink, 0, sizeof(*sink));
+  sink->w = w;
+  sink->binary = binary;
+  sink->rotate_bytes = rotate_bytes;
+  sink->rotate_ns = rotate_secs * 1000000000ull;
+  log_sink_start_segment(sink);
+}
+
+static void log_sink_flush_index(LogSink *sink) {
+  struct clog_index idx;
+  clog_chunk_to_index(&sink->chunk, &idx);
+  sink->last_index = sink->offset;
+  log_sink_put(sink, &idx, sizeof(idx));
+  clog_chunk_reset(&sink->chunk, sink->offset, sink->last_index);
+}
+
+// Binary segments end with their last index and a footer, so every rotated
+// file is a complete log for logreader.
+static void log_sink_finish_segment(LogSink *sink) {
+  if (!sink->binary)
+    return;
+  if (sink->chunk.count > 0)
+    log_sink_flush_index(sink);
+  struct clog_footer footer;
+  memcpy(footer.magic, CLOG_FOOTER_MAGIC, sizeof(footer.magic));
+  footer.last_index = sink->last_index;
+  log_sink_put(sink, &footer, sizeof(footer));
+}
+
+static void log_sink_maybe_rotate(LogSink *sink) {
+  if (sink->rotate_bytes == 0 && sink->rotate_ns == 0)
+    return;
+  if ((sink->rotate_bytes == 0 || sink->offset < sink->rotate_bytes) &&
+      (sink->rotate_ns == 0 ||
+       coarse_ns() - sink->segment_start_ns < sink->rotate_ns))
+    return;
+  if (!batch_writer_can_cut(sink->w))
+    return;
+  log_sink_finish_segment(sink);
+  batch_writer_cut(sink->w);
+  log_sink_start_segment(sink);
+}
+
+static void log_sink_append(LogSink *sink, uint32_t sender_ip,
+                            uint16_t sender_port, const char *ip_str,
+                            unsigned int port_num, const char *message,
+                            int content_len) {
+  if (!sink->binary) {
+    size_t max = 15 + 10 + content_len + 2;
+    char *dst = batch_writer_reserve(sink->w, max);
+    if (!dst)
+      return;
+    int n = snprintf(dst, max, "%-15s%-10u%.*s\n", ip_str, port_num,
+                     content_len, message);
+    n = n > 0 && (size_t)n < max ? n : 0;
+    batch_writer_commit(sink->w, n);
+    sink->offset += n;
+    log_sink_maybe_rotate(sink);
+    return;
+  }
+
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  uint64_t recv_ns = (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+  if (content_len > UINT16_MAX)
+    content_len = UINT16_MAX;
+  struct clog_record rec = {CLOG_TAG_RECORD, 0,           content_len,
+                            sender_ip,       sender_port, recv_ns};
+  char *dst = batch_writer_reserve(sink->w, sizeof(rec) + content_len);
+  if (!dst)
+    return;
+
+  // Upper-case hex payloads (everything this client sends) are stored as
+  // the raw bytes and re-encoded by logreader, halving their size.
+  uint8_t *packed = (uint8_t *)dst + sizeof(rec);
+  char check[2 * 1024];
+  if (content_len > 0 && content_len <= (int)sizeof(check) &&
+      hex_decode(message, content_len, packed) == content_len / 2 &&
+      hex_encode(packed, content_len / 2, check) == (size_t)content_len &&
+      memcmp(check, message, content_len) == 0) {
+    rec.flags = CLOG_FLAG_HEX;
+    rec.payload_len = content_len / 2;
+  } else {
+    memcpy(dst + sizeof(rec), message, content_len);
+  }
+  memcpy(dst, &rec, sizeof(rec));
+  size_t total = sizeof(rec) + rec.payload_len;
+  batch_writer_commit(sink->w, total);
+  sink->offset += total;
+
+  clog_chunk_add(&sink->chunk, sender_ip, sender_port, recv_ns);
+  if (sink->chunk.count == CLOG_INDEX_EVERY)
+    log_sink_flush_index(sink);
+  log_sink_maybe_rotate(sink);
+}
+
+static void log_sink_close(LogSink *sink) { log_sink_finish_segment(sink); }
+
+// Every payload starts with a big-endian sequence number and the monotonic
+// send time; when our own broadcast comes back the difference is one RTT
+// sample. Samples land in a log-linear histogram (HDR style: 2^HIST_SUB_BITS
+// linear sub-buckets per power of two, about 3% relative error).
+#define LATENCY_HEADER_BYTES 12
+#define HIST_SUB_BITS 5
+#define HIST_BUCKETS (64 << HIST_SUB_BITS)
+
+typedef struct {
+  int report_secs;
+  uint64_t next_report_ns;
+  uint64_t samples;
+  uint64_t out_of_order;
+  uint64_t min_ns;
+  uint64_t max_ns;
+  double sum_ns;
+  uint64_t counts[HIST_BUCKETS];
+} LatencyTracker;
+
+static uint64_t mono_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static size_t hist_index(uint64_t v) {
+  if (v < (1u << HIST_SUB_BITS))
+    return v;
+  int shift = 63 - __builtin_clzll(v) - HIST_SUB_BITS;
+  return ((size_t)(shift + 1) << HIST_SUB_BITS) +
+         ((v >> shift) & ((1u << HIST_SUB_BITS) - 1));
+}
+
+// Midpoint of a bucket's value range.
+static uint64_t hist_value(size_t idx) {
+  size_t b = idx >> HIST_SUB_BITS, sub = idx & ((1u << HIST_SUB_BITS) - 1);
+  if (b == 0)
+    return sub;
+  uint64_t lo = ((uint64_t)(1u << HIST_SUB_BITS) + sub) << (b - 1);
+  return lo + ((1ull << (b - 1)) >> 1);
+}
+
+static uint64_t hist_percentile(const LatencyTracker *lt, double pct) {
+  uint64_t rank = (uint64_t)(pct / 100.0 * lt->samples + 0.5);
+  if (rank == 0)
+    rank = 1;
+  uint64_t seen = 0;
+  for (size_t i = 0; i < HIST_BUCKETS; i++) {
+    seen += lt->counts[i];
+    if (seen >= rank)
+      return hist_value(i) > lt->max_ns ? lt->max_ns : hist_value(i);
+  }
+  return lt->max_ns;
+}
+
+static void latency_report(const LatencyTracker *lt, const char *when) {
+  if (lt->samples == 0) {
+    fprintf(stderr, "rtt %s: no samples\n", when);
+    return;
+  }
+  fprintf(stderr,
+          "rtt %s: n=%llu min=%.1fus mean=%.1fus p50=%.1fus p90=%.1fus "
+          "p99=%.1fus p99.9=%.1fus max=%.1fus reordered=%llu\n",
+          when, (unsigned long long)lt->samples, lt->min_ns / 1e3,
+          lt->sum_ns / lt->samples / 1e3, hist_percentile(lt, 50) / 1e3,
+          hist_percentile(lt, 90) / 1e3, hist_percentile(lt, 99) / 1e3,
+          hist_percentile(lt, 99.9) / 1e3, lt->max_ns / 1e3,
+          (unsigned long long)lt->out_of_order);
+}
+
+// last_seq belongs to the connection, so reordering is judged per stream even
+// when several connections share one tracker.
+static void latency_record(LatencyTracker *lt, uint64_t *last_seq,
+                           const char *hex, int hex_len) {
+  uint8_t hdr[LATENCY_HEADER_BYTES];
+  if (hex_len < LATENCY_HEADER_BYTES * 2 ||
+      hex_decode(hex, LATENCY_HEADER_BYTES * 2, hdr) < 0)
+    return;
+  uint32_t seq_be;
+  uint64_t sent_be;
+  memcpy(&seq_be, hdr, 4);
+  memcpy(&sent_be, hdr + 4, 8);
+  uint64_t seq = ntohl(seq_be), sent = be64toh(sent_be), now = mono_ns();
+  if (sent == 0 || sent > now)
+    return;
+  if (seq <= *last_seq)
+    lt->out_of_order++;
+  *last_seq = seq;
+
+  uint64_t rtt = now - sent;
+  if (lt->samples == 0 || rtt < lt->min_ns)
+    lt->min_ns = rtt;
+  if (rtt > lt->max_ns)
+    lt->max_ns = rtt;
+  lt->sum_ns += rtt;
+  lt->samples++;
+  lt->counts[hist_index(rtt)]++;
+
+  if (lt->report_secs > 0 && now >= lt->next_report_ns) {
+    if (lt->next_report_ns != 0)
+      latency_report(lt, "so far");
+    lt->next_report_ns = now + lt->report_secs * 1000000000ull;
+  }
+}
+
+typedef struct {
+  int fd;              // multicast socket, -1 when the server fans out over TCP
+  int sequenced;       // an announce has given us the server's sequence numbers
+  uint64_t live_seq;   // sequence number of the next type 0 frame over TCP
+  uint64_t next_seq;   // next sequence number to deliver
+  uint64_t end_seq;    // server's sequence number at last announce
+  uint64_t nacked_to;  // everything below this has already been NACKed
+  struct {
+    uint64_t seq;
+    int state; // 0 empty, 1 frame held, 2 lost
+    size_t len;
+    uint8_t data[MAX_FRAME_SIZE];
+  } stash[REORDER_WINDOW];
+} McastState;
+
+// One connection to the server. The receiver thread and the epoll loops of
+// the multi-connection mode share the parsing below; only the observer
+// connection has out/log set, the others just feed the RTT histogram.
 typedef struct {
   int sockfd;
-  char *log_file_path;
+  BatchWriter *out;
+  LogSink *log;
+  LatencyTracker *latency;
+  uint32_t self_ip; // our address as the server reports it (network order)
+  uint16_t self_port;
+  pthread_mutex_t *send_lock; // NULL: nonblocking socket, writes queue up
+  uint8_t *outq;
+  size_t outq_off, outq_len, outq_cap;
+  RingBuffer ring;
+  size_t scanned; // bytes of an incomplete frame already searched for '\n'
+  McastState *mc;
+  int shutdown_pending;
+  int finished;  // type 1 received and multicast stream complete
+  int sent;      // messages written so far (multi-connection mode)
+  int bye_sent;
+  uint64_t rtt_last_seq;
+  // Reconnect (thread mode only): the receiver replaces sockfd under
+  // send_lock and signals `reconnected`; a sender whose write failed waits
+  // there and resends.
+  const struct sockaddr_in *server;
+  int max_reconnects;
+  int resuming;      // reconnected, waiting for the server's announce
+  int receiver_gone;
+  pthread_cond_t reconnected;
+} Conn;
+
+typedef struct {
+  Conn *conn;
   volatile int *done;
 } ReceiverArgs;
 
-void *receiver_thread(void *arg) {
-  ReceiverArgs *params = (ReceiverArgs *)arg;
-  FILE *logfile = fopen(params->log_file_path, "w");
+static int connect_server(const struct sockaddr_in *server_addr) {
+  int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+  if (sockfd < 0) {
+    perror("socket");
+    return -1;
+  }
+  struct timeval tv;
+  tv.tv_sec = 3;
+  tv.tv_usec = 0;
+  setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  if (connect(sockfd, (const struct sockaddr *)server_addr,
+              sizeof(*server_addr)) < 0) {
+    perror("connect");
+    close(sockfd);
+    return -1;
+  }
+  return sockfd;
+}
+
+static int conn_init(Conn *c, int sockfd) {
+  memset(c, 0, sizeof(*c));
+  c->sockfd = sockfd;
+  struct sockaddr_in local_addr;
+  socklen_t local_len = sizeof(local_addr);
+  if (getsockname(sockfd, (struct sockaddr *)&local_addr, &local_len) == 0) {
+    c->self_ip = local_addr.sin_addr.s_addr;
+    c->self_port = local_addr.sin_port;
+  }
+  c->mc = calloc(1, sizeof(McastState));
+  if (!c->mc)
+    return -1;
+  c->mc->fd = -1;
+  if (ring_init(&c->ring, RING_INITIAL_SIZE) < 0) {
+    free(c->mc);
+    return -1;
+  }
+  return 0;
+}
+
+static void conn_destroy(Conn *c) {
+  ring_destroy(&c->ring);
+  if (c->mc->fd >= 0)
+    close(c->mc->fd);
+  free(c->mc);
+  free(c->outq);
+}
+
+// Set on the receiver thread: it is the one that reconnects, so its own
+// writes (NACK, resume) must not wait for a reconnect. Whatever they asked
+// for is covered by the resume request after reconnecting.
+static __thread int on_receiver_thread;
+
+// Blocking connections write under send_lock; if the connection drops, the
+// write waits for the receiver to reconnect and is repeated there. Nonblocking
+// ones write what the socket takes and queue the rest for conn_flush();
+// callers stop feeding a connection while its queue is non-empty.
+static int conn_write(Conn *c, const void *data, size_t len) {
+  if (c->send_lock) {
+    pthread_mutex_lock(c->send_lock);
+    int rc;
+    for (;;) {
+      int fd = c->sockfd;
+      rc = write_all(fd, data, len);
+      if (rc == 0 || c->max_reconnects == 0 || on_receiver_thread)
+        break;
+      while (c->sockfd == fd && !c->receiver_gone)
+        pthread_cond_wait(&c->reconnected, c->send_lock);
+      if (c->sockfd == fd)
+        break;
+    }
+    pthread_mutex_unlock(c->send_lock);
+    return rc;
+  }
+  if (c->outq_len == 0) {
+    ssize_t w = write(c->sockfd, data, len);
+    if (w < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+        return -1;
+      w = 0;
+    }
+    data = (const char *)data + w;
+    len -= w;
+    if (len == 0)
+      return 0;
+    c->outq_off = 0;
+  }
+  if (c->outq_off + c->outq_len + len > c->outq_cap) {
+    memmove(c->outq, c->outq + c->outq_off, c->outq_len);
+    c->outq_off = 0;
+    size_t cap = c->outq_cap ? c->outq_cap : 4096;
+    while (cap < c->outq_len + len)
+      cap *= 2;
+    if (cap != c->outq_cap) {
+      uint8_t *q = realloc(c->outq, cap);
+      if (!q)
+        return -1;
+      c->outq = q;
+      c->outq_cap = cap;
+    }
+  }
+  memcpy(c->outq + c->outq_off + c->outq_len, data, len);
+  c->outq_len += len;
+  return 0;
+}
+
+static int conn_flush(Conn *c) {
+  while (c->outq_len > 0) {
+    ssize_t w = write(c->sockfd, c->outq + c->outq_off, c->outq_len);
+    if (w < 0) {
+      if (errno == EINTR)
+        continue;
+      return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+    }
+    c->outq_off += w;
+    c->outq_len -= w;
+  }
+  c->outq_off = 0;
+  return 0;
+}
+
+static void deliver_frame(Conn *c, const uint8_t *frame, size_t len) {
+  if (len < 8 || frame[0] != 0)
+    return;
+  uint32_t sender_ip;
+  uint16_t sender_port;
+  memcpy(&sender_ip, frame + 1, sizeof(sender_ip));
+  memcpy(&sender_port, frame + 5, sizeof(sender_port));
+  int content_len = (int)len - 8;
+  const char *message = (const char *)frame + 7;
+  if (sender_ip == c->self_ip && sender_port == c->self_port)
+    latency_record(c->latency, &c->rtt_last_seq, message, content_len);
+  if (!c->out)
+    return;
+
+  struct in_addr ip_addr;
+  ip_addr.s_addr = sender_ip;
+  char ip_str[INET_ADDRSTRLEN];
+  inet_ntop(AF_INET, &ip_addr, ip_str, sizeof(ip_str));
+  unsigned int port_num = ntohs(sender_port);
+
+  size_t max = 15 + 10 + content_len + 2;
+  char *dst = batch_writer_reserve(c->out, max);
+  if (dst) {
+    int n = snprintf(dst, max, "%-15s%-10u%.*s\n", ip_str, port_num,
+                     content_len, message);
+    batch_writer_commit(c->out, n > 0 && (size_t)n < max ? n : 0);
+  }
+  log_sink_append(c->log, sender_ip, sender_port, ip_str, port_num, message,
+                  content_len);
+}
+
+static void send_nack(Conn *c, uint64_t first, uint32_t count) {
+  uint8_t msg[1 + 8 + 4];
+  uint64_t first_be = htobe64(first);
+  uint32_t count_be = htonl(count);
+  msg[0] = MSG_NACK;
+  memcpy(msg + 1, &first_be, 8);
+  memcpy(msg + 9, &count_be, 4);
+  if (conn_write(c, msg, sizeof(msg)) < 0)
+    perror("write nack");
+}
+
+static void send_resume(Conn *c, uint64_t from) {
+  uint8_t msg[1 + 8];
+  uint64_t from_be = htobe64(from);
+  msg[0] = MSG_RESUME;
+  memcpy(msg + 1, &from_be, 8);
+  if (conn_write(c, msg, sizeof(msg)) < 0)
+    perror("write resume");
+}
+
+// Asks the server to number its frames for us, so we can resume after a
+// reconnect; without it the server keeps to the plain type 0 / type 1 stream.
+static void send_hello(Conn *c) {
+  uint8_t msg = MSG_HELLO;
+  if (conn_write(c, &msg, 1) < 0)
+    perror("write hello");
+}
+
+static void mcast_request_missing(Conn *c, uint64_t upto) {
+  McastState *mc = c->mc;
+  uint64_t from = mc->nacked_to > mc->next_seq ? mc->nacked_to : mc->next_seq;
+  if (upto > from) {
+    send_nack(c, from, (uint32_t)(upto - from));
+    mc->nacked_to = upto;
+  }
+}
+
+static void mcast_drain(Conn *c) {
+  McastState *mc = c->mc;
+  for (;;) {
+    size_t slot = mc->next_seq % REORDER_WINDOW;
+    if (mc->stash[slot].state == 0 || mc->stash[slot].seq != mc->next_seq)
+      break;
+    if (mc->stash[slot].state == 1)
+      deliver_frame(c, mc->stash[slot].data, mc->stash[slot].len);
+    mc->stash[slot].state = 0;
+    mc->next_seq++;
+  }
+}
+
+static void mcast_accept(Conn *c, uint64_t seq, const uint8_t *frame,
+                         size_t len) {
+  McastState *mc = c->mc;
+  if (seq >= mc->next_seq + REORDER_WINDOW) {
+    // Far ahead, e.g. the stream started before we joined: fetch the window
+    // over TCP so delivery can catch up with the datagrams.
+    mcast_request_missing(c, mc->next_seq + REORDER_WINDOW);
+    return;
+  }
+  if (seq < mc->next_seq || len > MAX_FRAME_SIZE)
+    return;
+  if (seq == mc->next_seq) {
+    deliver_frame(c, frame, len);
+    mc->next_seq++;
+    mcast_drain(c);
+    return;
+  }
+  size_t slot = seq % REORDER_WINDOW;
+  mc->stash[slot].seq = seq;
+  mc->stash[slot].state = 1;
+  mc->stash[slot].len = len;
+  memcpy(mc->stash[slot].data, frame, len);
+  mcast_request_missing(c, seq);
+}
+
+static void mcast_mark_lost(Conn *c, uint64_t first, uint32_t count) {
+  McastState *mc = c->mc;
+  uint64_t end = first + count;
+  uint64_t from = first > mc->next_seq ? first : mc->next_seq;
+  uint64_t to = end < mc->next_seq + REORDER_WINDOW
+                    ? end
+                    : mc->next_seq + REORDER_WINDOW;
+  for (uint64_t seq = from; seq < to; seq++) {
+    size_t slot = seq % REORDER_WINDOW;
+    if (mc->stash[slot].state == 1 && mc->stash[slot].seq == seq)
+      continue;
+    mc->stash[slot].seq = seq;
+    mc->stash[slot].state = 2;
+  }
+  mcast_drain(c);
+  // A gap wider than the window cannot be stashed; skip the rest of it.
+  if (first <= mc->next_seq && end > mc->next_seq) {
+    mc->next_seq = end;
+    mcast_drain(c);
+  }
+}
+
+static int mcast_join(Conn *c, const uint8_t *announce) {
+  struct sockaddr_in group;
+  memset(&group, 0, sizeof(group));
+  group.sin_family = AF_INET;
+  memcpy(&group.sin_addr.s_addr, announce + 1, 4);
+  memcpy(&group.sin_port, announce + 5, 2);
+
+  int fd = socket(AF_INET, SOCK_DGRAM, 0);
+  if (fd < 0) {
+    perror("multicast socket");
+    return -1;
+  }
+  int opt = 1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+  int rcvbuf = 4 << 20;
+  setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+  if (bind(fd, (struct sockaddr *)&group, sizeof(group)) < 0) {
+    perror("multicast bind");
+    close(fd);
+    return -1;
+  }
+
+  // Join on the interface we reach the server through, so loopback testing
+  // against 127.0.0.1 works without any routing setup.
+  struct ip_mreq mreq;
+  mreq.imr_multiaddr = group.sin_addr;
+  mreq.imr_interface.s_addr = c->self_ip ? c->self_ip : htonl(INADDR_ANY);
+  if (setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0) {
+    perror("IP_ADD_MEMBERSHIP");
+    close(fd);
+    return -1;
+  }
+  c->mc->fd = fd;
+  return 0;
+}
+
+static void conn_read_datagrams(Conn *c) {
+  uint8_t dgram[8 + MAX_FRAME_SIZE];
+  ssize_t dlen;
+  while ((dlen = recv(c->mc->fd, dgram, sizeof(dgram), MSG_DONTWAIT)) > 8) {
+    uint64_t seq_be;
+    memcpy(&seq_be, dgram, 8);
+    mcast_accept(c, be64toh(seq_be), dgram + 8, dlen - 8);
+  }
+}
 
-  if (!logfile) {
-    perror("fopen log file");
-    pthread_exit(NULL);
+// The server announces its next sequence number when we join (on accept in
+// multicast mode, otherwise in answer to our hello) and before it shuts down.
+// The first announce anchors our sequence numbers (and joins the multicast
+// group if one is named); the one after a reconnect asks for just what was
+// broadcast while we were away.
+static void conn_announce(Conn *c, const uint8_t *msg) {
+  McastState *mc = c->mc;
+  uint32_t group_ip;
+  uint64_t seq_be;
+  memcpy(&group_ip, msg + 1, 4);
+  memcpy(&seq_be, msg + 7, 8);
+  uint64_t seq = be64toh(seq_be);
+  mc->end_seq = seq;
+  if (c->resuming && mc->sequenced && seq < mc->next_seq) {
+    // A restarted server numbers from scratch; nothing to resume.
+    if (c->out)
+      printf("Server sequence restarted at %llu\n", (unsigned long long)seq);
+    mc->sequenced = 0;
+    for (size_t i = 0; i < REORDER_WINDOW; i++)
+      mc->stash[i].state = 0;
   }
+  if (!mc->sequenced) {
+    mc->sequenced = 1;
+    mc->next_seq = seq;
+    mc->nacked_to = seq;
+    mc->live_seq = seq;
+    if (group_ip != 0 && mc->fd < 0 && mcast_join(c, msg) == 0 && c->out)
+      printf("Joined multicast fanout at sequence %llu\n",
+             (unsigned long long)seq);
+  } else if (c->resuming) {
+    mc->live_seq = seq;
+    if (seq > mc->next_seq) {
+      if (c->out)
+        printf("Resuming at sequence %llu, %llu messages missed\n",
+               (unsigned long long)mc->next_seq,
+               (unsigned long long)(seq - mc->next_seq));
+      send_resume(c, mc->next_seq);
+      if (mc->nacked_to < seq)
+        mc->nacked_to = seq;
+    }
+  }
+  c->resuming = 0;
+}
 
-  uint8_t buffer[4096];
-  int buf_len = 0;
-  while (1) {
-    uint8_t recv_buf[1024];
-    ssize_t rlen = read(params->sockfd, recv_buf, sizeof(recv_buf));
-    if (rlen < 0) {
-      if (*(params->done)) {
+static void conn_check_finished(Conn *c) {
+  if (c->shutdown_pending && c->mc->next_seq >= c->mc->end_seq)
+    c->finished = 1;
+}
+
+// Reads once into the ring. Returns the byte count, 0 at EOF, -1 on error.
+static ssize_t conn_read(Conn *c) {
+  if (ring_free(&c->ring) < RING_MIN_READ && ring_grow(&c->ring) < 0) {
+    perror("ring_grow");
+    return -1;
+  }
+  ssize_t rlen = read(c->sockfd, ring_space(&c->ring), ring_free(&c->ring));
+  if (rlen > 0)
+    c->ring.len += rlen;
+  return rlen;
+}
+
+// Handles every complete frame in the ring, stopping after the server's
+// type 1.
+static void conn_parse(Conn *c) {
+  McastState *mc = c->mc;
+  uint8_t *buffer = ring_data(&c->ring);
+  size_t buf_len = c->ring.len;
+  size_t pos = 0;
+  while (pos < buf_len && !c->finished) {
+    uint8_t msg_type = buffer[pos];
+    if (msg_type == 1) {
+      pos += 1;
+      if (mc->sequenced && mc->next_seq < mc->end_seq) {
+        // Stay around until the tail of the stream is in.
+        mcast_request_missing(c, mc->end_seq);
+        c->shutdown_pending = 1;
+        continue;
+      }
+      c->finished = 1;
+    } else if (msg_type == 0) {
+
+      if (buf_len - pos < 7)
+        break;
+      size_t from = pos + (c->scanned > 7 ? c->scanned : 7);
+      uint8_t *nl = memchr(buffer + from, '\n', buf_len - from);
+      if (!nl) {
+        c->scanned = buf_len - pos;
         break;
       }
+      size_t newline_pos = nl - buffer;
+
+      // Frames that beat the announce on a new connection are dropped; the
+      // resume request covers everything up to the announce.
+      if (!mc->sequenced)
+        deliver_frame(c, buffer + pos, newline_pos + 1 - pos);
+      else if (!c->resuming)
+        mcast_accept(c, mc->live_seq++, buffer + pos, newline_pos + 1 - pos);
+      pos = newline_pos + 1;
+      c->scanned = 0;
+    } else if (msg_type == MSG_RETRANSMIT) {
+      if (buf_len - pos < 9 + 7)
+        break;
+      size_t from = pos + (c->scanned > 9 + 7 ? c->scanned : 9 + 7);
+      uint8_t *nl = memchr(buffer + from, '\n', buf_len - from);
+      if (!nl) {
+        c->scanned = buf_len - pos;
+        break;
+      }
+      size_t newline_pos = nl - buffer;
+      c->scanned = 0;
+      uint64_t seq_be;
+      memcpy(&seq_be, buffer + pos + 1, 8);
+      mcast_accept(c, be64toh(seq_be), buffer + pos + 9,
+                   newline_pos + 1 - (pos + 9));
+      pos = newline_pos + 1;
+    } else if (msg_type == MSG_GAP) {
+      if (buf_len - pos < 13)
+        break;
+      uint64_t first_be;
+      uint32_t count_be;
+      memcpy(&first_be, buffer + pos + 1, 8);
+      memcpy(&count_be, buffer + pos + 9, 4);
+      mcast_mark_lost(c, be64toh(first_be), ntohl(count_be));
+      pos += 13;
+    } else if (msg_type == MSG_ANNOUNCE) {
+      if (buf_len - pos < 15)
+        break;
+      conn_announce(c, buffer + pos);
+      pos += 15;
+    } else {
+      pos += 1;
+    }
+  }
+  ring_consume(&c->ring, pos);
+  conn_check_finished(c);
+}
+
+// Replaces a dropped connection. Attempts back off exponentially with jitter,
+// so the clients of a restarted server do not all come back at once.
+static int conn_reconnect(Conn *c) {
+  int fd = -1;
+  for (int attempt = 0; attempt < c->max_reconnects && fd < 0; attempt++) {
+    long cap = (long)RECONNECT_BASE_MS << (attempt < 10 ? attempt : 10);
+    if (cap > RECONNECT_MAX_MS)
+      cap = RECONNECT_MAX_MS;
+    long ms = cap / 2 + (long)(mono_ns() % (cap / 2 + 1));
+    struct timespec ts = {ms / 1000, ms % 1000 * 1000000L};
+    nanosleep(&ts, NULL);
+    fd = connect_server(c->server);
+  }
+  if (fd < 0)
+    return -1;
+
+  pthread_mutex_lock(c->send_lock);
+  int old_fd = c->sockfd;
+  c->sockfd = fd;
+  struct sockaddr_in local_addr;
+  socklen_t local_len = sizeof(local_addr);
+  if (getsockname(fd, (struct sockaddr *)&local_addr, &local_len) == 0) {
+    c->self_ip = local_addr.sin_addr.s_addr;
+    c->self_port = local_addr.sin_port;
+  }
+  pthread_cond_broadcast(&c->reconnected);
+  pthread_mutex_unlock(c->send_lock);
+  // Closed only now so the new socket cannot reuse the number a waiting
+  // sender is comparing against.
+  close(old_fd);
+  ring_consume(&c->ring, c->ring.len);
+  c->scanned = 0;
+  c->resuming = 1;
+  send_hello(c);
+  printf("Reconnected to server\n");
+  return 0;
+}
+
+void *receiver_thread(void *arg) {
+  ReceiverArgs *params = (ReceiverArgs *)arg;
+  Conn *c = params->conn;
+  on_receiver_thread = 1;
+  if (c->max_reconnects > 0)
+    send_hello(c);
+  while (!c->finished) {
+    struct pollfd pfds[2] = {{c->sockfd, POLLIN, 0}, {c->mc->fd, POLLIN, 0}};
+    int ready = poll(pfds, c->mc->fd >= 0 ? 2 : 1, RECV_IDLE_TIMEOUT_MS);
+    // A paced sender can leave the stream quiet for longer than the idle
+    // timeout; it only ends the wait for the server's type 1 once our own
+    // type 1 is out.
+    if (ready == 0 && !*(params->done))
+      continue;
+    if (ready <= 0) {
+      if (ready < 0 && errno == EINTR)
+        continue;
       break;
     }
-    if (rlen == 0) {
+
+    if (c->mc->fd >= 0 && (pfds[1].revents & POLLIN)) {
+      conn_read_datagrams(c);
+      conn_check_finished(c);
+    }
+    if (c->finished ||
+        !(pfds[0].revents & (POLLIN | POLLHUP | POLLERR)))
+      continue;
+
+    ssize_t rlen = conn_read(c);
+    if (rlen <= 0) {
+      if (c->max_reconnects > 0) {
+        printf("server closed connection. Reconnecting\n");
+        fflush(stdout);
+        if (conn_reconnect(c) == 0)
+          continue;
+      }
       printf("server closed connection. Exiting receiver\n");
       break;
     }
+    conn_parse(c);
+  }
+  if (c->finished) {
+    printf("Recieved type 1 (shutdown) from server. Exiting\n");
+    *(params->done) = 1;
+  }
+  pthread_mutex_lock(c->send_lock);
+  c->receiver_gone = 1;
+  pthread_cond_broadcast(&c->reconnected);
+  pthread_mutex_unlock(c->send_lock);
+  pthread_exit(NULL);
+}
+
+// ChaCha20 keystream used as a userspace CSPRNG: seeded from getentropy()
+// once, re-keyed from its own output after every refill (fast key erasure)
+// and reseeded from the kernel every CSPRNG_RESEED_BYTES. Four blocks are
+// computed side by side with vector extensions, so the compiler can keep them
+// in SIMD registers.
+#define CSPRNG_RESEED_BYTES (1ull << 30)
+#define CSPRNG_BLOCKS 4
+#define CSPRNG_CHUNK (64 * CSPRNG_BLOCKS)
+
+typedef uint32_t v4u32 __attribute__((vector_size(16)));
+
+typedef struct {
+  uint32_t key[8];
+  uint64_t counter;
+  uint64_t since_reseed;
+  uint8_t buf[CSPRNG_CHUNK];
+  size_t avail;
+  int seeded;
+} Csprng;
+
+static __thread Csprng thread_rng;
+
+#define ROTL(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+#define QR(a, b, c, d)                                                         \
+  a += b;                                                                      \
+  d ^= a;                                                                      \
+  d = ROTL(d, 16);                                                             \
+  c += d;                                                                      \
+  b ^= c;                                                                      \
+  b = ROTL(b, 12);                                                             \
+  a += b;                                                                      \
+  d ^= a;                                                                      \
+  d = ROTL(d, 8);                                                              \
+  c += d;                                                                      \
+  b ^= c;                                                                      \
+  b = ROTL(b, 7);
+
+// Writes CSPRNG_CHUNK bytes of keystream (blocks counter .. counter + 3).
+static void chacha20_blocks(const uint32_t key[8], uint64_t counter,
+                            uint8_t out[CSPRNG_CHUNK]) {
+  static const uint32_t sigma[4] = {0x61707865, 0x3320646e, 0x79622d32,
+                                    0x6b206574};
+  v4u32 in[16], x[16];
+  for (int i = 0; i < 4; i++)
+    in[i] = (v4u32){sigma[i], sigma[i], sigma[i], sigma[i]};
+  for (int i = 0; i < 8; i++)
+    in[4 + i] = (v4u32){key[i], key[i], key[i], key[i]};
+  for (int b = 0; b < CSPRNG_BLOCKS; b++) {
+    in[12][b] = (uint32_t)(counter + b);
+    in[13][b] = (uint32_t)((counter + b) >> 32);
+  }
+  in[14] = (v4u32){0, 0, 0, 0};
+  in[15] = (v4u32){0, 0, 0, 0};
+  memcpy(x, in, sizeof(x));
+  for (int r = 0; r < 10; r++) {
+    QR(x[0], x[4], x[8], x[12]);
+    QR(x[1], x[5], x[9], x[13]);
+    QR(x[2], x[6], x[10], x[14]);
+    QR(x[3], x[7], x[11], x[15]);
+    QR(x[0], x[5], x[10], x[15]);
+    QR(x[1], x[6], x[11], x[12]);
+    QR(x[2], x[7], x[8], x[13]);
+    QR(x[3], x[4], x[9], x[14]);
+  }
+  for (int i = 0; i < 16; i++)
+    x[i] += in[i];
+  for (int b = 0; b < CSPRNG_BLOCKS; b++)
+    for (int i = 0; i < 16; i++)
+      memcpy(out + b * 64 + i * 4, &x[i][b], 4);
+}
+
+static int csprng_reseed(Csprng *rng) {
+  uint32_t fresh[8];
+  if (getentropy(fresh, sizeof(fresh)) != 0)
+    return -1;
+  for (int i = 0; i < 8; i++)
+    rng->key[i] ^= fresh[i];
+  rng->since_reseed = 0;
+  rng->seeded = 1;
+  return 0;
+}
+
+// Refills the buffer; its first 32 bytes become the next key and are wiped.
+static int csprng_refill(Csprng *rng) {
+  if ((!rng->seeded || rng->since_reseed >= CSPRNG_RESEED_BYTES) &&
+      csprng_reseed(rng) < 0)
+    return -1;
+  chacha20_blocks(rng->key, rng->counter, rng->buf);
+  rng->counter += CSPRNG_BLOCKS;
+  memcpy(rng->key, rng->buf, sizeof(rng->key));
+  memset(rng->buf, 0, sizeof(rng->key));
+  rng->avail = CSPRNG_CHUNK - sizeof(rng->key);
+  rng->since_reseed += CSPRNG_CHUNK;
+  return 0;
+}
+
+// Fills dst with len random bytes from the calling thread's generator. Bulk
+// requests are written straight into dst, a whole chunk at a time, whenever
+// the buffer runs dry; the refill that follows replaces the key they were made
+// with, so it never outlives them.
+static int csprng_fill(void *dst, size_t len) {
+  Csprng *rng = &thread_rng;
+  uint8_t *out = dst;
+  while (len > 0) {
+    if (rng->avail == 0) {
+      if ((!rng->seeded || rng->since_reseed >= CSPRNG_RESEED_BYTES) &&
+          csprng_reseed(rng) < 0)
+        return -1;
+      for (; len >= CSPRNG_CHUNK; len -= CSPRNG_CHUNK) {
+        chacha20_blocks(rng->key, rng->counter, out);
+        rng->counter += CSPRNG_BLOCKS;
+        rng->since_reseed += CSPRNG_CHUNK;
+        out += CSPRNG_CHUNK;
+      }
+      if (csprng_refill(rng) < 0)
+        return -1;
+      if (len == 0)
+        break;
+    }
+    size_t n = len < rng->avail ? len : rng->avail;
+    uint8_t *src = rng->buf + CSPRNG_CHUNK - rng->avail;
+    memcpy(out, src, n);
+    memset(src, 0, n);
+    rng->avail -= n;
+    out += n;
+    len -= n;
+  }
+  return 0;
+}
+
+#define MAX_PAYLOAD_BYTES 500 // hex frame must fit the server's 1 KB buffers
+#define DEFAULT_PAYLOAD_BYTES 16
+#define DEFAULT_BURST 64
+
+// Message generation runs one batch ahead of the socket: a generator thread
+// fills one slot while the sender writes the other with a single write().
+typedef struct {
+  uint8_t *data;
+  size_t len;
+  int first;
+  int count;
+  int filled;
+} SendBatch;
+
+typedef struct {
+  int payload_bytes;
+  int burst;
+  int total;
+  volatile int *done;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  SendBatch slots[2];
+  uint8_t *rand_buf; // generator thread only
+} SendPipeline;
+
+static size_t frame_size(int payload_bytes) { return 1 + payload_bytes * 2 + 1; }
+
+// Turns payload_bytes * count random bytes into type 0 frames for messages
+// first + 1 .. first + count.
+static int build_frames(uint8_t *out, uint8_t *rand_bytes, int payload_bytes,
+                        int first, int count) {
+  for (int i = 0; i < count; i++, rand_bytes += payload_bytes) {
+    if (payload_bytes >= LATENCY_HEADER_BYTES) {
+      // The send time is stamped by the sender right before the write.
+      uint32_t seq_be = htonl(first + i + 1);
+      memcpy(rand_bytes, &seq_be, 4);
+      memset(rand_bytes + 4, 0, 8);
+    }
+    out[0] = 0;
+    if (convert(rand_bytes, payload_bytes, (char *)out + 1,
+                payload_bytes * 2 + 1) != 0) {
+      fprintf(stderr, "Conversion error\n");
+      return -1;
+    }
+    out[1 + payload_bytes * 2] = '\n';
+    out += frame_size(payload_bytes);
+  }
+  return 0;
+}
+
+static void stamp_frames(uint8_t *frames, int payload_bytes, int count) {
+  if (payload_bytes < LATENCY_HEADER_BYTES)
+    return;
+  size_t fsz = frame_size(payload_bytes);
+  uint64_t sent_be = htobe64(mono_ns());
+  for (int i = 0; i < count; i++)
+    hex_encode((const uint8_t *)&sent_be, 8, (char *)frames + i * fsz + 9);
+}
+
+static void echo_sent(BatchWriter *out, const uint8_t *frames,
+                      int payload_bytes, int first, int count) {
+  size_t fsz = frame_size(payload_bytes);
+  size_t line_max = 32 + payload_bytes * 2;
+  char *dst = batch_writer_reserve(out, line_max * count);
+  if (!dst)
+    return;
+  size_t used = 0;
+  for (int i = 0; i < count; i++) {
+    int n = snprintf(dst + used, line_max, "sent message %d: %.*s\n",
+                     first + i + 1, payload_bytes * 2,
+                     (const char *)frames + i * fsz + 1);
+    if (n > 0 && (size_t)n < line_max)
+      used += n;
+  }
+  batch_writer_commit(out, used);
+}
+
+static int fill_batch(SendPipeline *p, SendBatch *b, int first, int count) {
+  if (csprng_fill(p->rand_buf, (size_t)p->payload_bytes * count) < 0) {
+    perror("getentropy");
+    return -1;
+  }
+  if (build_frames(b->data, p->rand_buf, p->payload_bytes, first, count) < 0)
+    return -1;
+  b->len = frame_size(p->payload_bytes) * count;
+  b->first = first;
+  b->count = count;
+  return 0;
+}
+
+static void *generator_thread(void *arg) {
+  SendPipeline *p = arg;
+  for (int first = 0, k = 0; first < p->total; first += p->burst, k++) {
+    SendBatch *b = &p->slots[k % 2];
+    pthread_mutex_lock(&p->lock);
+    while (b->filled && !*(p->done))
+      pthread_cond_wait(&p->cond, &p->lock);
+    pthread_mutex_unlock(&p->lock);
+    if (*(p->done))
+      break;
+    int count = p->total - first < p->burst ? p->total - first : p->burst;
+    int rc = fill_batch(p, b, first, count);
+    pthread_mutex_lock(&p->lock);
+    b->filled = rc == 0 ? 1 : -1;
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+    if (rc != 0)
+      break;
+  }
+  return NULL;
+}
+
+// Sends `total` frames in bursts of p->burst, pacing bursts so that the
+// average rate stays at `rate` messages per second (0 = as fast as possible).
+static int run_sender(Conn *c, BatchWriter *out, SendPipeline *p, double rate) {
+  size_t slot_size = frame_size(p->payload_bytes) * p->burst;
+  p->rand_buf = malloc((size_t)p->payload_bytes * p->burst);
+  if (!p->rand_buf)
+    return -1;
+  for (int i = 0; i < 2; i++) {
+    p->slots[i].data = malloc(slot_size);
+    p->slots[i].filled = 0;
+    if (!p->slots[i].data)
+      return -1;
+  }
+  pthread_mutex_init(&p->lock, NULL);
+  pthread_cond_init(&p->cond, NULL);
+  pthread_t gen_tid;
+  if (pthread_create(&gen_tid, NULL, generator_thread, p) != 0)
+    return -1;
+
+  struct timespec next;
+  clock_gettime(CLOCK_MONOTONIC, &next);
+  long burst_ns = rate > 0 ? (long)(p->burst * 1e9 / rate) : 0;
+  int rc = 0;
+  for (int sent = 0, k = 0; sent < p->total && !*(p->done); k++) {
+    SendBatch *b = &p->slots[k % 2];
+    pthread_mutex_lock(&p->lock);
+    while (b->filled == 0)
+      pthread_cond_wait(&p->cond, &p->lock);
+    pthread_mutex_unlock(&p->lock);
+    if (b->filled < 0) {
+      rc = -1;
+      break;
+    }
 
-    if (buf_len + rlen > (int)sizeof(buffer)) {
-      fprintf(stderr, "Buffer Overflow\n");
+    if (burst_ns > 0) {
+      clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+      next.tv_nsec += burst_ns;
+      next.tv_sec += next.tv_nsec / 1000000000L;
+      next.tv_nsec %= 1000000000L;
+    }
+    stamp_frames(b->data, p->payload_bytes, b->count);
+    if (conn_write(c, b->data, b->len) < 0) {
+      perror("write");
+      rc = -1;
       break;
     }
+    echo_sent(out, b->data, p->payload_bytes, b->first, b->count);
+    sent += b->count;
+
+    pthread_mutex_lock(&p->lock);
+    b->filled = 0;
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+  }
 
-    memcpy(buffer + buf_len, recv_buf, rlen);
-    buf_len += rlen;
+  pthread_mutex_lock(&p->lock);
+  *(p->done) = *(p->done) || rc != 0;
+  pthread_cond_broadcast(&p->cond);
+  pthread_mutex_unlock(&p->lock);
+  pthread_join(gen_tid, NULL);
+  free(p->slots[0].data);
+  free(p->slots[1].data);
+  free(p->rand_buf);
+  pthread_cond_destroy(&p->cond);
+  pthread_mutex_destroy(&p->lock);
+  return rc;
+}
 
-    int pos = 0;
-    while (pos < buf_len) {
-      uint8_t msg_type = buffer[pos];
-      if (msg_type == 1) {
-        printf("Recieved type 1 (shutdown) from server. Exiting\n");
-        *(params->done) = 1;
-        fclose(logfile);
-        pthread_exit(NULL);
-      } else if (msg_type == 0) {
+#define MAX_EVENTS 64
+#define TIMER_TAG UINT64_MAX
 
-        if (buf_len - pos < 7)
-          break;
-        int newline_pos = -1;
-        for (int j = pos + 7; j < buf_len; j++) {
-          if (buffer[j] == '\n') {
-            newline_pos = j;
-            break;
-          }
-        }
-        if (newline_pos == -1)
-          break;
-
-        uint32_t sender_ip;
-        uint16_t sender_port;
-        memcpy(&sender_ip, buffer + pos + 1, sizeof(sender_ip));
-        memcpy(&sender_port, buffer + pos + 5, sizeof(sender_port));
-        struct in_addr ip_addr;
-        ip_addr.s_addr = sender_ip;
-        char ip_str[INET_ADDRSTRLEN];
-        inet_ntop(AF_INET, &ip_addr, ip_str, sizeof(ip_str));
-        unsigned int port_num = ntohs(sender_port);
-
-        int content_start = pos + 7;
-        int content_len = newline_pos - content_start;
-        char message[1024];
-        if (content_len > 0 && content_len < 1024) {
-          memcpy(message, buffer + content_start, content_len);
+// Multi-connection mode (-c): each loop thread drives a slice of the
+// connections from one epoll set. A timerfd paces the loop's share of the
+// aggregate rate, and every tick hands bursts round-robin to connections
+// whose earlier writes have drained, so one slow socket never holds up the
+// rest. Frames are generated inline from the loop's own CSPRNG.
+typedef struct {
+  Conn *conns;
+  int n;
+  int payload_bytes;
+  int burst;
+  int total;   // messages per connection
+  double rate; // this loop's share, 0 = as fast as possible
+  LatencyTracker latency;
+  int dropped; // connections closed before their type 1 was sent
+  pthread_t tid;
+} EventLoop;
+
+static int loop_send_burst(EventLoop *L, Conn *c, uint8_t *rand_buf,
+                           uint8_t *frames, int count) {
+  if (csprng_fill(rand_buf, (size_t)L->payload_bytes * count) < 0) {
+    perror("getentropy");
+    return -1;
+  }
+  if (build_frames(frames, rand_buf, L->payload_bytes, c->sent, count) < 0)
+    return -1;
+  stamp_frames(frames, L->payload_bytes, count);
+  if (conn_write(c, frames, frame_size(L->payload_bytes) * count) < 0) {
+    perror("write");
+    return -1;
+  }
+  if (c->out)
+    echo_sent(c->out, frames, L->payload_bytes, c->sent, count);
+  c->sent += count;
+  if (c->sent == L->total) {
+    uint8_t type1_msg = 1;
+    if (conn_write(c, &type1_msg, 1) < 0) {
+      perror("write type 1");
+      return -1;
+    }
+    c->bye_sent = 1;
+    if (c->out)
+      printf("Sent type 1 (shutdown) message to server.\n");
+  }
+  return 0;
+}
+
+static void loop_close(EventLoop *L, Conn *c) {
+  if (!c->bye_sent)
+    L->dropped++;
+  close(c->sockfd);
+  c->sockfd = -1;
+  if (c->mc->fd >= 0) {
+    close(c->mc->fd);
+    c->mc->fd = -1;
+  }
+  if (c->finished && c->out)
+    printf("Recieved type 1 (shutdown) from server. Exiting\n");
+}
+
+// Keeps EPOLLOUT armed exactly while the connection has queued bytes.
+static void loop_rearm(int epfd, Conn *c, int idx, uint32_t *armed) {
+  uint32_t want = c->outq_len > 0 ? EPOLLIN | EPOLLOUT : EPOLLIN;
+  if (want == armed[idx])
+    return;
+  struct epoll_event ev = {.events = want, .data.u64 = (uint64_t)idx << 1};
+  epoll_ctl(epfd, EPOLL_CTL_MOD, c->sockfd, &ev);
+  armed[idx] = want;
+}
+
+static void *event_loop_thread(void *arg) {
+  EventLoop *L = arg;
+  uint8_t *rand_buf = malloc((size_t)L->payload_bytes * L->burst);
+  uint8_t *frames = malloc(frame_size(L->payload_bytes) * L->burst);
+  uint32_t *armed = calloc(L->n, sizeof(*armed));
+  char *udp_added = calloc(L->n, 1);
+  int epfd = epoll_create1(0);
+  int tfd = L->rate > 0 ? timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK) : -1;
+  if (!rand_buf || !frames || !armed || !udp_added || epfd < 0 ||
+      (L->rate > 0 && tfd < 0)) {
+    perror("event loop setup");
+    goto out;
+  }
+
+  for (int i = 0; i < L->n; i++) {
+    struct epoll_event ev = {.events = EPOLLIN, .data.u64 = (uint64_t)i << 1};
+    L->conns[i].latency = &L->latency;
+    armed[i] = EPOLLIN;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, L->conns[i].sockfd, &ev) < 0) {
+      perror("epoll_ctl");
+      goto out;
+    }
+  }
+  // Credit accrues one burst per tick, capped so a stall is not followed by
+  // an unbounded catch-up burst.
+  uint64_t credit = UINT64_MAX, credit_cap = (uint64_t)L->n * L->burst;
+  long burst_ns = tfd >= 0 ? (long)(L->burst * 1e9 / L->rate) : 0;
+  if (tfd >= 0 && burst_ns == 0) {
+    // A zero interval would make the timer one-shot; a rate this high is
+    // as good as unlimited.
+    close(tfd);
+    tfd = -1;
+  }
+  if (tfd >= 0) {
+    struct itimerspec its = {{burst_ns / 1000000000L, burst_ns % 1000000000L},
+                             {0, 1}};
+    timerfd_settime(tfd, 0, &its, NULL);
+    struct epoll_event ev = {.events = EPOLLIN, .data.u64 = TIMER_TAG};
+    epoll_ctl(epfd, EPOLL_CTL_ADD, tfd, &ev);
+    credit = 0;
+  }
+
+  int open = L->n, rr = 0;
+  while (open > 0) {
+    int pending = 0, writable = 0;
+    for (int k = 0; k < L->n; k++) {
+      int i = (rr + k) % L->n;
+      Conn *c = &L->conns[i];
+      if (c->sockfd < 0 || c->bye_sent)
+        continue;
+      pending++;
+      if (c->outq_len > 0)
+        continue;
+      int count = L->total - c->sent < L->burst ? L->total - c->sent : L->burst;
+      if ((uint64_t)count > credit)
+        count = (int)credit;
+      if (count > 0 || c->sent == L->total) {
+        if (loop_send_burst(L, c, rand_buf, frames, count) < 0) {
+          loop_close(L, c);
+          open--;
+          continue;
         }
-        message[content_len > 0 ? content_len : 0] = '\0';
+        if (tfd >= 0)
+          credit -= count;
+        loop_rearm(epfd, c, i, armed);
+      }
+      writable += !c->bye_sent && c->outq_len == 0;
+    }
+    rr = (rr + 1) % L->n;
+    if (pending == 0 && tfd >= 0) {
+      close(tfd);
+      tfd = -1;
+    }
 
-        printf("%-15s%-10u%s\n", ip_str, port_num, message);
-        fflush(stdout);
-        fprintf(logfile, "%-15s%-10u%s\n", ip_str, port_num, message);
-        fflush(logfile);
-        pos = newline_pos + 1;
+    // While anything is left to send, wait for the burst timer or for queues
+    // to drain however long that takes; only once every type 1 is out does a
+    // quiet spell mean the server has nothing more for us.
+    struct epoll_event events[MAX_EVENTS];
+    int timeout = writable && credit > 0 ? 0
+                  : pending > 0          ? -1
+                                         : RECV_IDLE_TIMEOUT_MS;
+    int nev = epoll_wait(epfd, events, MAX_EVENTS, timeout);
+    if (nev < 0) {
+      if (errno == EINTR)
+        continue;
+      perror("epoll_wait");
+      break;
+    }
+    if (nev == 0 && timeout > 0)
+      break;
+
+    for (int e = 0; e < nev; e++) {
+      if (events[e].data.u64 == TIMER_TAG) {
+        uint64_t ticks;
+        if (tfd >= 0 && read(tfd, &ticks, sizeof(ticks)) == sizeof(ticks)) {
+          credit += ticks * L->burst;
+          if (credit > credit_cap)
+            credit = credit_cap;
+        }
+        continue;
+      }
+      int i = (int)(events[e].data.u64 >> 1);
+      Conn *c = &L->conns[i];
+      if (c->sockfd < 0)
+        continue;
+      if (events[e].data.u64 & 1) {
+        conn_read_datagrams(c);
+        conn_check_finished(c);
       } else {
-        pos += 1;
+        int failed = (events[e].events & EPOLLOUT) && conn_flush(c) < 0;
+        if (!failed && (events[e].events & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+          ssize_t rlen = conn_read(c);
+          if (rlen > 0)
+            conn_parse(c);
+          else if (rlen == 0 || (errno != EAGAIN && errno != EINTR))
+            failed = 1;
+        }
+        if (failed) {
+          loop_close(L, c);
+          open--;
+          continue;
+        }
       }
-    }
-    if (pos > 0) {
-      if (pos < buf_len) {
-        memmove(buffer, buffer + pos, buf_len - pos);
+      if (c->finished) {
+        loop_close(L, c);
+        open--;
+        continue;
       }
-      buf_len -= pos;
+      if (c->mc->fd >= 0 && !udp_added[i]) {
+        struct epoll_event ev = {.events = EPOLLIN,
+                                 .data.u64 = (uint64_t)i << 1 | 1};
+        epoll_ctl(epfd, EPOLL_CTL_ADD, c->mc->fd, &ev);
+        udp_added[i] = 1;
+      }
+      loop_rearm(epfd, c, i, armed);
     }
   }
-  fclose(logfile);
-  pthread_exit(NULL);
+
+out:
+  if (tfd >= 0)
+    close(tfd);
+  if (epfd >= 0)
+    close(epfd);
+  free(udp_added);
+  free(armed);
+  free(frames);
+  free(rand_buf);
+  return NULL;
+}
+
+static void latency_merge(LatencyTracker *dst, const LatencyTracker *src) {
+  if (src->samples == 0)
+    return;
+  if (dst->samples == 0 || src->min_ns < dst->min_ns)
+    dst->min_ns = src->min_ns;
+  if (src->max_ns > dst->max_ns)
+    dst->max_ns = src->max_ns;
+  dst->samples += src->samples;
+  dst->out_of_order += src->out_of_order;
+  dst->sum_ns += src->sum_ns;
+  for (size_t i = 0; i < HIST_BUCKETS; i++)
+    dst->counts[i] += src->counts[i];
+}
+
+// Spreads the connections over `loops` threads and waits for all of them.
+// Fails if any connection was lost before it sent everything.
+static int run_event_loops(Conn *conns, int n, int loops, int payload_bytes,
+                           int burst, int total, double rate, int report_secs,
+                           LatencyTracker *latency) {
+  EventLoop *ev = calloc(loops, sizeof(EventLoop));
+  if (!ev)
+    return -1;
+  int started = 0;
+  for (int t = 0, first = 0; t < loops; t++) {
+    int count = n / loops + (t < n % loops);
+    ev[t].conns = conns + first;
+    ev[t].n = count;
+    ev[t].payload_bytes = payload_bytes;
+    ev[t].burst = burst;
+    ev[t].total = total;
+    ev[t].rate = rate * count / n;
+    ev[t].latency.report_secs = report_secs;
+    first += count;
+    if (pthread_create(&ev[t].tid, NULL, event_loop_thread, &ev[t]) != 0) {
+      perror("pthread_create");
+      break;
+    }
+    started++;
+  }
+  int dropped = 0;
+  for (int t = 0; t < started; t++) {
+    pthread_join(ev[t].tid, NULL);
+    latency_merge(latency, &ev[t].latency);
+    dropped += ev[t].dropped;
+  }
+  free(ev);
+  if (dropped > 0)
+    fprintf(stderr, "%d connections closed before sending all messages\n",
+            dropped);
+  return started == loops && dropped == 0 ? 0 : -1;
+}
+
+#define DEFAULT_GZIP_LEVEL 6
+
+static uint64_t parse_size(const char *str) {
+  char *end;
+  uint64_t n = strtoull(str, &end, 10);
+  switch (*end) {
+  case 'g':
+  case 'G':
+    n <<= 10;
+    // fall through
+  case 'm':
+  case 'M':
+    n <<= 10;
+    // fall through
+  case 'k':
+  case 'K':
+    n <<= 10;
+  }
+  return n;
+}
+
+static void usage(const char *prog) {
+  fprintf(stderr,
+          "Usage: %s [options] <IP address> <port number> <# of messages> "
+          "<log file path>\n"
+          "  -d <ms>   fdatasync the log at most every <ms> milliseconds "
+          "(default 0: never)\n"
+          "  -f <fmt>  log format: text (default) or binary, see logreader\n"
+          "  -r <n>    send at most <n> messages per second (default: "
+          "unlimited)\n"
+          "  -b <n>    frames generated and written per batch (default %d)\n"
+          "  -s <n>    payload bytes per message, 1-%d (default %d); the "
+          "first %d\n"
+          "            carry a sequence number and send time for RTT "
+          "tracking\n"
+          "  -l <s>    also report RTT percentiles every <s> seconds\n"
+          "  -c <n>    open <n> connections driven by epoll loops; the first "
+          "one\n"
+          "            is printed and logged, -r is the total for all of them\n"
+          "  -t <n>    epoll loop threads for -c (default 1, 0: one per "
+          "CPU)\n"
+          "  -R <n>    reconnect attempts after the server goes away, with "
+          "backoff\n"
+          "            and resume from the last message (default %d, 0: off; "
+          "not with -c)\n"
+          "  -S <size> rotate the log to <path>.<n> at this size (k/M/G "
+          "suffixes)\n"
+          "  -T <s>    rotate the log every <s> seconds\n"
+          "  -z <n>    gzip level for rotated segments (default %d, 0: keep "
+          "raw)\n"
+          "  -K <n>    keep only the newest <n> rotated segments\n",
+          prog, DEFAULT_BURST, MAX_PAYLOAD_BYTES, DEFAULT_PAYLOAD_BYTES,
+          LATENCY_HEADER_BYTES, DEFAULT_RECONNECTS, DEFAULT_GZIP_LEVEL);
+  exit(EXIT_FAILURE);
 }
 
 int main(int argc, char *argv[]) {
-  if (argc != 5) {
-    fprintf(stderr,
-            "Usage: %s <IP address> <port number> <# of messages> <log file "
-            "path>\n",
-            argv[0]);
-    exit(EXIT_FAILURE);
+  int sync_ms = 0;
+  int binary_log = 0;
+  double rate = 0;
+  int burst = DEFAULT_BURST;
+  int payload_bytes = DEFAULT_PAYLOAD_BYTES;
+  int report_secs = 0;
+  int connections = 1;
+  int loops = 1;
+  int reconnects = DEFAULT_RECONNECTS;
+  uint64_t rotate_bytes = 0;
+  int rotate_secs = 0;
+  int gzip_level = DEFAULT_GZIP_LEVEL;
+  int keep_segments = 0;
+  int c;
+  while ((c = getopt(argc, argv, "d:f:r:b:s:l:c:t:R:S:T:z:K:")) != -1) {
+    switch (c) {
+    case 'd':
+      sync_ms = atoi(optarg);
+      break;
+    case 'f':
+      if (strcmp(optarg, "binary") == 0)
+        binary_log = 1;
+      else if (strcmp(optarg, "text") != 0)
+        usage(argv[0]);
+      break;
+    case 'r':
+      rate = atof(optarg);
+      break;
+    case 'b':
+      burst = atoi(optarg);
+      break;
+    case 's':
+      payload_bytes = atoi(optarg);
+      break;
+    case 'l':
+      report_secs = atoi(optarg);
+      break;
+    case 'c':
+      connections = atoi(optarg);
+      break;
+    case 't':
+      loops = atoi(optarg);
+      if (loops == 0)
+        loops = (int)sysconf(_SC_NPROCESSORS_ONLN);
+      break;
+    case 'R':
+      reconnects = atoi(optarg);
+      break;
+    case 'S':
+      rotate_bytes = parse_size(optarg);
+      break;
+    case 'T':
+      rotate_secs = atoi(optarg);
+      break;
+    case 'z':
+      gzip_level = atoi(optarg);
+      break;
+    case 'K':
+      keep_segments = atoi(optarg);
+      break;
+    default:
+      usage(argv[0]);
+    }
   }
+  if (argc - optind != 4 || burst < 1 || payload_bytes < 1 ||
+      payload_bytes > MAX_PAYLOAD_BYTES || connections < 1 || loops < 1 ||
+      reconnects < 0 || rotate_secs < 0 || gzip_level < 0 || gzip_level > 9 ||
+      keep_segments < 0)
+    usage(argv[0]);
+  if (loops > connections)
+    loops = connections;
 
-  char *server_ip = argv[1];
-  int port = atoi(argv[2]);
-  int num_messages = atoi(argv[3]);
-  char *log_file_path = argv[4];
+  char *server_ip = argv[optind];
+  int port = atoi(argv[optind + 1]);
+  int num_messages = atoi(argv[optind + 2]);
+  char *log_file_path = argv[optind + 3];
 
-  int sockfd = socket(AF_INET, SOCK_STREAM, 0);
-  if (sockfd < 0) {
-    perror("socket");
+  int log_fd = open(log_file_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (log_fd < 0) {
+    perror("open log file");
     exit(EXIT_FAILURE);
   }
-  struct timeval tv;
-  tv.tv_sec = 3;
-  setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
 
   struct sockaddr_in server_addr;
+  memset(&server_addr, 0, sizeof(server_addr));
   server_addr.sin_family = AF_INET;
   server_addr.sin_port = htons(port);
 
@@ -152,65 +1991,112 @@ int main(int argc, char *argv[]) {
     exit(EXIT_FAILURE);
   }
 
-  if (connect(sockfd, (struct sockaddr *)&server_addr, sizeof(server_addr)) <
-      0) {
-    perror("connect");
+  // A dropped connection shows up as a failed write, not a signal.
+  signal(SIGPIPE, SIG_IGN);
+
+  Conn *conns = calloc(connections, sizeof(Conn));
+  if (!conns) {
+    perror("calloc");
     exit(EXIT_FAILURE);
   }
+  for (int i = 0; i < connections; i++) {
+    int sockfd = connect_server(&server_addr);
+    if (sockfd < 0 || conn_init(&conns[i], sockfd) < 0)
+      exit(EXIT_FAILURE);
+  }
 
-  printf("Connected to server %s:%d\n", server_ip, port);
+  if (connections == 1)
+    printf("Connected to server %s:%d\n", server_ip, port);
+  else
+    printf("Connected to server %s:%d with %d connections on %d loops\n",
+           server_ip, port, connections, loops);
+  fflush(stdout);
 
   volatile int done = 0;
-  ReceiverArgs recv_args = {sockfd, log_file_path, &done};
-  pthread_t recv_tid;
-  if (pthread_create(&recv_tid, NULL, receiver_thread, &recv_args) != 0) {
-    perror("pthread_create");
-    close(sockfd);
+  pthread_mutex_t send_lock = PTHREAD_MUTEX_INITIALIZER;
+  BatchWriter out_writer, log_writer;
+  if (batch_writer_start(&out_writer, STDOUT_FILENO, 0) < 0 ||
+      batch_writer_start(&log_writer, log_fd, sync_ms) < 0) {
+    fprintf(stderr, "failed to start output writers\n");
     exit(EXIT_FAILURE);
   }
-
-  int msg_bytes = 16;
-  uint8_t rand_bytes[16];
-  char hex_msg[16 * 2 + 1];
-
-  for (int i = 0; i < num_messages && !done; i++) {
-
-    if (getentropy(rand_bytes, msg_bytes) != 0) {
-      perror("getentropy");
+  LogRotator rotator;
+  int rotating = rotate_bytes > 0 || rotate_secs > 0;
+  if (rotating) {
+    if (log_rotator_start(&rotator, log_file_path, gzip_level,
+                          keep_segments) < 0) {
+      fprintf(stderr, "failed to start log rotation\n");
       exit(EXIT_FAILURE);
     }
-    if (convert(rand_bytes, msg_bytes, hex_msg, sizeof(hex_msg)) != 0) {
-      fprintf(stderr, "Conversion error\n");
+    log_writer.rotate = log_rotator_rotate;
+    log_writer.rotate_arg = &rotator;
+  }
+  LogSink log_sink;
+  log_sink_init(&log_sink, &log_writer, binary_log, rotate_bytes, rotate_secs);
+  static LatencyTracker latency;
+  latency.report_secs = report_secs;
+  // The first connection is the observer whose traffic is printed and logged.
+  Conn *conn = &conns[0];
+  conn->out = &out_writer;
+  conn->log = &log_sink;
+
+  int failed = 0;
+  if (connections > 1) {
+    for (int i = 0; i < connections; i++)
+      fcntl(conns[i].sockfd, F_SETFL,
+            fcntl(conns[i].sockfd, F_GETFL) | O_NONBLOCK);
+    // The logs are still flushed when some connections failed.
+    failed = run_event_loops(conns, connections, loops, payload_bytes, burst,
+                             num_messages, rate, report_secs, &latency) < 0;
+  } else {
+    conn->latency = &latency;
+    conn->send_lock = &send_lock;
+    conn->server = &server_addr;
+    conn->max_reconnects = reconnects;
+    pthread_cond_init(&conn->reconnected, NULL);
+    ReceiverArgs recv_args = {conn, &done};
+    pthread_t recv_tid;
+    if (pthread_create(&recv_tid, NULL, receiver_thread, &recv_args) != 0) {
+      perror("pthread_create");
+      close(conn->sockfd);
       exit(EXIT_FAILURE);
     }
 
-    size_t hex_len = strlen(hex_msg);
-    uint8_t send_buf[64];
-    send_buf[0] = 0;
-    memcpy(send_buf + 1, hex_msg, hex_len);
-    send_buf[1 + hex_len] = '\n';
+    SendPipeline pipeline = {.payload_bytes = payload_bytes,
+                             .burst = burst,
+                             .total = num_messages,
+                             .done = &done};
+    if (run_sender(conn, &out_writer, &pipeline, rate) < 0)
+      exit(EXIT_FAILURE);
 
-    size_t total_len = 1 + hex_len + 1;
-    ssize_t w = write(sockfd, send_buf, total_len);
-    if (w != total_len) {
-      perror("write");
+    uint8_t type1_msg = 1;
+    if (conn_write(conn, &type1_msg, 1) < 0) {
+      perror("write type 1");
+      close(conn->sockfd);
       exit(EXIT_FAILURE);
     }
-    printf("sent message %d: %s\n", i + 1, hex_msg);
-  }
+    printf("Sent type 1 (shutdown) message to server.\n");
 
-  uint8_t type1_msg = 1;
-  if (write(sockfd, &type1_msg, 1) != 1) {
-    perror("write type 1");
-    close(sockfd);
-    exit(EXIT_FAILURE);
+    done = 1;
+    // Keep the write side open: the server only sends type 1 to clients that
+    // are still connected, and a multicast listener may need to NACK the tail.
+    pthread_join(recv_tid, NULL);
   }
-  printf("Sent type 1 (shutdown) message to server.\n");
+  fflush(stdout);
+  log_sink_close(&log_sink);
+  batch_writer_stop(&out_writer);
+  if (payload_bytes >= LATENCY_HEADER_BYTES)
+    latency_report(&latency, "final");
+  batch_writer_stop(&log_writer);
+  close(log_writer.fd); // log_fd unless the log was rotated
+  if (rotating)
+    log_rotator_stop(&rotator);
 
-  done = 1;
-  shutdown(sockfd, SHUT_WR);
-  pthread_join(recv_tid, NULL);
-
-  close(sockfd);
-  return 0;
+  for (int i = 0; i < connections; i++) {
+    if (conns[i].sockfd >= 0)
+      close(conns[i].sockfd);
+    conn_destroy(&conns[i]);
+  }
+  free(conns);
+  return failed ? EXIT_FAILURE : 0;
 }
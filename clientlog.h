@@ -0,0 +1,113 @@
+// Binary message log written by client.c (-f binary) and read by logreader.c.
+//
+// Layout: an 8-byte file magic, then a stream of tagged blocks:
+//   record  - one received message: raw sender ip/port as they arrived on the
+//             wire (network order), receive time and payload bytes; with
+//             CLOG_FLAG_HEX the payload was upper-case hex on the wire and is
+//             stored decoded
+//   index   - written after every CLOG_INDEX_EVERY records; summarises the
+//             chunk of records before it (offset, time range, sender bloom
+//             over both ip:port and bare ip) and links to the previous index
+//   footer  - written on clean close; points at the last index so a reader
+//             can walk the index chain backwards without touching records
+// Multi-byte integers other than ip/port are little-endian host order.
+#ifndef CLIENTLOG_H
+#define CLIENTLOG_H
+
+#include <stdint.h>
+#include <string.h>
+
+#define CLOG_MAGIC "CLOGv1\n"
+#define CLOG_MAGIC_LEN 8
+#define CLOG_FOOTER_MAGIC "CLOGEND"
+#define CLOG_INDEX_EVERY 1024
+#define CLOG_NO_INDEX UINT64_MAX
+
+enum { CLOG_TAG_RECORD = 'R', CLOG_TAG_INDEX = 'I' };
+enum { CLOG_FLAG_HEX = 1 };
+
+struct __attribute__((packed)) clog_record {
+  uint8_t tag;
+  uint8_t flags;
+  uint16_t payload_len;
+  uint32_t sender_ip;
+  uint16_t sender_port;
+  uint64_t recv_ns;
+  // payload_len bytes of payload follow
+};
+
+struct __attribute__((packed)) clog_index {
+  uint8_t tag;
+  uint32_t count;
+  uint64_t chunk_offset;
+  uint64_t prev_index;
+  uint64_t min_ns;
+  uint64_t max_ns;
+  uint64_t sender_bloom[4];
+};
+
+struct __attribute__((packed)) clog_footer {
+  char magic[8];
+  uint64_t last_index;
+};
+
+// Running state of the chunk that the next index block will describe.
+struct clog_chunk {
+  uint64_t offset;
+  uint64_t prev_index;
+  uint32_t count;
+  uint64_t min_ns;
+  uint64_t max_ns;
+  uint64_t sender_bloom[4];
+};
+
+static inline uint32_t clog_sender_hash(uint32_t ip, uint16_t port) {
+  uint64_t x = ((uint64_t)ip << 16 | port) * 0x9E3779B97F4A7C15ull;
+  return (uint32_t)(x >> 32);
+}
+
+static inline void clog_bloom_add(uint64_t bloom[4], uint32_t ip,
+                                  uint16_t port) {
+  uint32_t h = clog_sender_hash(ip, port);
+  bloom[(h >> 6) & 3] |= 1ull << (h & 63);
+  bloom[(h >> 14) & 3] |= 1ull << ((h >> 8) & 63);
+}
+
+static inline int clog_bloom_test(const uint64_t bloom[4], uint32_t ip,
+                                  uint16_t port) {
+  uint32_t h = clog_sender_hash(ip, port);
+  return (bloom[(h >> 6) & 3] >> (h & 63) & 1) &&
+         (bloom[(h >> 14) & 3] >> ((h >> 8) & 63) & 1);
+}
+
+static inline void clog_chunk_reset(struct clog_chunk *c, uint64_t offset,
+                                    uint64_t prev_index) {
+  memset(c, 0, sizeof(*c));
+  c->offset = offset;
+  c->prev_index = prev_index;
+  c->min_ns = UINT64_MAX;
+}
+
+static inline void clog_chunk_add(struct clog_chunk *c, uint32_t ip,
+                                  uint16_t port, uint64_t recv_ns) {
+  c->count++;
+  if (recv_ns < c->min_ns)
+    c->min_ns = recv_ns;
+  if (recv_ns > c->max_ns)
+    c->max_ns = recv_ns;
+  clog_bloom_add(c->sender_bloom, ip, port);
+  clog_bloom_add(c->sender_bloom, ip, 0);
+}
+
+static inline void clog_chunk_to_index(const struct clog_chunk *c,
+                                       struct clog_index *idx) {
+  idx->tag = CLOG_TAG_INDEX;
+  idx->count = c->count;
+  idx->chunk_offset = c->offset;
+  idx->prev_index = c->prev_index;
+  idx->min_ns = c->min_ns;
+  idx->max_ns = c->max_ns;
+  memcpy(idx->sender_bloom, c->sender_bloom, sizeof(idx->sender_bloom));
+}
+
+#endif
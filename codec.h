@@ -0,0 +1,521 @@
+// Hex and base64 codecs with SIMD fast paths, shared by client.c, logreader.c
+// and codec_bench.c.
+//
+// Every codec has a table-driven scalar version and, on x86, SSSE3 and AVX2
+// versions. The plain entry points (hex_encode() etc.) dispatch to the best
+// version the running CPU supports, except that inputs shorter than one AVX2
+// block stay on the SSSE3 path, which is faster there; the suffixed ones are
+// exposed so the benchmark can compare them.
+//
+// Hex output is upper case to match what the client has always sent; the
+// decoders accept either case and return -1 on any invalid input.
+#ifndef CODEC_H
+#define CODEC_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/types.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define CODEC_X86 1
+#include <immintrin.h>
+#endif
+
+static const char codec_hex_digits[] = "0123456789ABCDEF";
+static const char codec_b64_alphabet[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+static uint16_t codec_hex_pairs[256]; // byte -> two ASCII digits, in memory order
+static int8_t codec_hex_values[256];  // ASCII -> nibble, -1 if not hex
+static int8_t codec_b64_values[256];  // ASCII -> sextet, -1 if not base64
+
+static size_t (*codec_hex_encode_impl)(const uint8_t *, size_t, char *);
+static ssize_t (*codec_hex_decode_impl)(const char *, size_t, uint8_t *);
+static size_t (*codec_b64_encode_impl)(const uint8_t *, size_t, char *);
+static ssize_t (*codec_b64_decode_impl)(const char *, size_t, uint8_t *);
+// Below the lengths here the AVX2 versions would only run their tails.
+#define CODEC_HEX_ENCODE_BLOCK 32
+#define CODEC_HEX_DECODE_BLOCK 64
+#define CODEC_B64_ENCODE_BLOCK 28
+#define CODEC_B64_DECODE_BLOCK 33
+static size_t (*codec_hex_encode_short)(const uint8_t *, size_t, char *);
+static ssize_t (*codec_hex_decode_short)(const char *, size_t, uint8_t *);
+static size_t (*codec_b64_encode_short)(const uint8_t *, size_t, char *);
+static ssize_t (*codec_b64_decode_short)(const char *, size_t, uint8_t *);
+static const char *codec_impl_name = "scalar";
+
+/* ---------------------------- scalar ---------------------------- */
+
+static size_t hex_encode_scalar(const uint8_t *src, size_t len, char *dst) {
+  for (size_t i = 0; i < len; i++)
+    memcpy(dst + i * 2, &codec_hex_pairs[src[i]], 2);
+  return len * 2;
+}
+
+static ssize_t hex_decode_scalar(const char *src, size_t len, uint8_t *dst) {
+  if (len % 2)
+    return -1;
+  for (size_t i = 0; i < len / 2; i++) {
+    int hi = codec_hex_values[(uint8_t)src[i * 2]];
+    int lo = codec_hex_values[(uint8_t)src[i * 2 + 1]];
+    if ((hi | lo) < 0)
+      return -1;
+    dst[i] = (uint8_t)(hi << 4 | lo);
+  }
+  return len / 2;
+}
+
+static size_t base64_encode_scalar(const uint8_t *src, size_t len, char *dst) {
+  char *out = dst;
+  size_t i = 0;
+  for (; i + 3 <= len; i += 3) {
+    uint32_t v = (uint32_t)src[i] << 16 | (uint32_t)src[i + 1] << 8 | src[i + 2];
+    *out++ = codec_b64_alphabet[v >> 18];
+    *out++ = codec_b64_alphabet[(v >> 12) & 63];
+    *out++ = codec_b64_alphabet[(v >> 6) & 63];
+    *out++ = codec_b64_alphabet[v & 63];
+  }
+  if (i < len) {
+    uint32_t v = (uint32_t)src[i] << 16;
+    if (i + 1 < len)
+      v |= (uint32_t)src[i + 1] << 8;
+    *out++ = codec_b64_alphabet[v >> 18];
+    *out++ = codec_b64_alphabet[(v >> 12) & 63];
+    *out++ = i + 1 < len ? codec_b64_alphabet[(v >> 6) & 63] : '=';
+    *out++ = '=';
+  }
+  return out - dst;
+}
+
+static ssize_t base64_decode_scalar(const char *src, size_t len, uint8_t *dst) {
+  if (len % 4)
+    return -1;
+  uint8_t *out = dst;
+  for (size_t i = 0; i < len; i += 4) {
+    int pad = 0;
+    if (i + 4 == len)
+      pad = (src[i + 3] == '=') + (src[i + 3] == '=' && src[i + 2] == '=');
+    int a = codec_b64_values[(uint8_t)src[i]];
+    int b = codec_b64_values[(uint8_t)src[i + 1]];
+    int c = pad >= 2 ? 0 : codec_b64_values[(uint8_t)src[i + 2]];
+    int d = pad >= 1 ? 0 : codec_b64_values[(uint8_t)src[i + 3]];
+    if ((a | b | c | d) < 0)
+      return -1;
+    uint32_t v = (uint32_t)a << 18 | (uint32_t)b << 12 | (uint32_t)c << 6 | d;
+    *out++ = v >> 16;
+    if (pad < 2)
+      *out++ = (v >> 8) & 0xFF;
+    if (pad < 1)
+      *out++ = v & 0xFF;
+  }
+  return out - dst;
+}
+
+/* ---------------------------- x86 SIMD ---------------------------- */
+
+#ifdef CODEC_X86
+
+// The 128-bit steps are inline helpers so the AVX2 versions can finish their
+// tails with VEX-encoded code instead of calling into legacy SSE (and paying
+// the AVX/SSE transition penalty).
+__attribute__((target("ssse3"))) static inline void
+hex_encode16_ssse3(const uint8_t *src, char *dst) {
+  const __m128i digits = _mm_loadu_si128((const __m128i *)codec_hex_digits);
+  const __m128i low4 = _mm_set1_epi8(0x0F);
+  __m128i in = _mm_loadu_si128((const __m128i *)src);
+  __m128i hi =
+      _mm_shuffle_epi8(digits, _mm_and_si128(_mm_srli_epi16(in, 4), low4));
+  __m128i lo = _mm_shuffle_epi8(digits, _mm_and_si128(in, low4));
+  _mm_storeu_si128((__m128i *)dst, _mm_unpacklo_epi8(hi, lo));
+  _mm_storeu_si128((__m128i *)(dst + 16), _mm_unpackhi_epi8(hi, lo));
+}
+
+__attribute__((target("ssse3"))) static size_t
+hex_encode_ssse3(const uint8_t *src, size_t len, char *dst) {
+  size_t i = 0;
+  for (; i + 16 <= len; i += 16)
+    hex_encode16_ssse3(src + i, dst + i * 2);
+  hex_encode_scalar(src + i, len - i, dst + i * 2);
+  return len * 2;
+}
+
+__attribute__((target("avx2"))) static size_t
+hex_encode_avx2(const uint8_t *src, size_t len, char *dst) {
+  const __m256i digits = _mm256_broadcastsi128_si256(
+      _mm_loadu_si128((const __m128i *)codec_hex_digits));
+  const __m256i low4 = _mm256_set1_epi8(0x0F);
+  size_t i = 0;
+  for (; i + 32 <= len; i += 32) {
+    __m256i in = _mm256_loadu_si256((const __m256i *)(src + i));
+    __m256i hi = _mm256_shuffle_epi8(
+        digits, _mm256_and_si256(_mm256_srli_epi16(in, 4), low4));
+    __m256i lo = _mm256_shuffle_epi8(digits, _mm256_and_si256(in, low4));
+    // unpack works per 128-bit lane: a = bytes 0-7 | 16-23, b = 8-15 | 24-31
+    __m256i a = _mm256_unpacklo_epi8(hi, lo);
+    __m256i b = _mm256_unpackhi_epi8(hi, lo);
+    _mm256_storeu_si256((__m256i *)(dst + i * 2),
+                        _mm256_permute2x128_si256(a, b, 0x20));
+    _mm256_storeu_si256((__m256i *)(dst + i * 2 + 32),
+                        _mm256_permute2x128_si256(a, b, 0x31));
+  }
+  if (i + 16 <= len) {
+    hex_encode16_ssse3(src + i, dst + i * 2);
+    i += 16;
+  }
+  hex_encode_scalar(src + i, len - i, dst + i * 2);
+  return len * 2;
+}
+
+// Turns 16 ASCII hex digits into nibble values; *bad gets 0xFF lanes for
+// anything that is not [0-9A-Fa-f].
+__attribute__((target("ssse3"))) static inline __m128i
+hex_nibbles_ssse3(__m128i c, __m128i *bad) {
+  __m128i lower = _mm_or_si128(c, _mm_set1_epi8(0x20));
+  __m128i digit = _mm_sub_epi8(c, _mm_set1_epi8('0'));
+  __m128i alpha = _mm_sub_epi8(lower, _mm_set1_epi8('a'));
+  __m128i is_digit =
+      _mm_cmpeq_epi8(_mm_min_epu8(digit, _mm_set1_epi8(9)), digit);
+  __m128i is_alpha =
+      _mm_cmpeq_epi8(_mm_min_epu8(alpha, _mm_set1_epi8(5)), alpha);
+  *bad = _mm_or_si128(*bad, _mm_andnot_si128(_mm_or_si128(is_digit, is_alpha),
+                                             _mm_set1_epi8(-1)));
+  return _mm_or_si128(
+      _mm_and_si128(is_digit, digit),
+      _mm_and_si128(is_alpha, _mm_add_epi8(alpha, _mm_set1_epi8(10))));
+}
+
+// Decodes 32 hex digits into 16 bytes.
+__attribute__((target("ssse3"))) static inline void
+hex_decode32_ssse3(const char *src, uint8_t *dst, __m128i *bad) {
+  const __m128i weights = _mm_set1_epi16(0x0110); // hi * 16 + lo
+  __m128i a =
+      hex_nibbles_ssse3(_mm_loadu_si128((const __m128i *)src), bad);
+  __m128i b =
+      hex_nibbles_ssse3(_mm_loadu_si128((const __m128i *)(src + 16)), bad);
+  _mm_storeu_si128((__m128i *)dst,
+                   _mm_packus_epi16(_mm_maddubs_epi16(a, weights),
+                                    _mm_maddubs_epi16(b, weights)));
+}
+
+__attribute__((target("ssse3"))) static ssize_t
+hex_decode_ssse3(const char *src, size_t len, uint8_t *dst) {
+  if (len % 2)
+    return -1;
+  __m128i bad = _mm_setzero_si128();
+  size_t i = 0;
+  for (; i + 32 <= len; i += 32)
+    hex_decode32_ssse3(src + i, dst + i / 2, &bad);
+  if (_mm_movemask_epi8(bad))
+    return -1;
+  if (hex_decode_scalar(src + i, len - i, dst + i / 2) < 0)
+    return -1;
+  return len / 2;
+}
+
+__attribute__((target("avx2"))) static inline __m256i
+hex_nibbles_avx2(__m256i c, __m256i *bad) {
+  __m256i lower = _mm256_or_si256(c, _mm256_set1_epi8(0x20));
+  __m256i digit = _mm256_sub_epi8(c, _mm256_set1_epi8('0'));
+  __m256i alpha = _mm256_sub_epi8(lower, _mm256_set1_epi8('a'));
+  __m256i is_digit =
+      _mm256_cmpeq_epi8(_mm256_min_epu8(digit, _mm256_set1_epi8(9)), digit);
+  __m256i is_alpha =
+      _mm256_cmpeq_epi8(_mm256_min_epu8(alpha, _mm256_set1_epi8(5)), alpha);
+  *bad = _mm256_or_si256(
+      *bad, _mm256_andnot_si256(_mm256_or_si256(is_digit, is_alpha),
+                                _mm256_set1_epi8(-1)));
+  return _mm256_or_si256(
+      _mm256_and_si256(is_digit, digit),
+      _mm256_and_si256(is_alpha, _mm256_add_epi8(alpha, _mm256_set1_epi8(10))));
+}
+
+__attribute__((target("avx2"))) static ssize_t
+hex_decode_avx2(const char *src, size_t len, uint8_t *dst) {
+  if (len % 2)
+    return -1;
+  const __m256i weights = _mm256_set1_epi16(0x0110);
+  __m256i bad = _mm256_setzero_si256();
+  size_t i = 0;
+  for (; i + 64 <= len; i += 64) {
+    __m256i a = hex_nibbles_avx2(
+        _mm256_loadu_si256((const __m256i *)(src + i)), &bad);
+    __m256i b = hex_nibbles_avx2(
+        _mm256_loadu_si256((const __m256i *)(src + i + 32)), &bad);
+    // packus interleaves lanes; restore byte order with a 64-bit permute.
+    __m256i out = _mm256_packus_epi16(_mm256_maddubs_epi16(a, weights),
+                                      _mm256_maddubs_epi16(b, weights));
+    _mm256_storeu_si256((__m256i *)(dst + i / 2),
+                        _mm256_permute4x64_epi64(out, 0xD8));
+  }
+  __m128i bad128 = _mm_setzero_si128();
+  if (i + 32 <= len) {
+    hex_decode32_ssse3(src + i, dst + i / 2, &bad128);
+    i += 32;
+  }
+  if (_mm256_movemask_epi8(bad) || _mm_movemask_epi8(bad128))
+    return -1;
+  if (hex_decode_scalar(src + i, len - i, dst + i / 2) < 0)
+    return -1;
+  return len / 2;
+}
+
+// Base64 codecs after Muła and Lemire, "Faster Base64 Encoding and Decoding
+// using AVX2 Instructions": 12 input bytes <-> 16 characters per 128-bit lane.
+static const int8_t codec_b64_enc_shuf[16] = {
+    1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10};
+static const int8_t codec_b64_enc_shift[16] = {
+    'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+    '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62,
+    '/' - 63, 'A',      0,        0};
+static const int8_t codec_b64_dec_lo[16] = {
+    0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+    0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A};
+static const int8_t codec_b64_dec_hi[16] = {
+    0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+    0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10};
+static const int8_t codec_b64_dec_roll[16] = {
+    0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0};
+static const int8_t codec_b64_dec_pack[16] = {
+    2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1};
+
+__attribute__((target("ssse3"))) static inline __m128i
+codec_b64_lut(const int8_t *table) {
+  return _mm_loadu_si128((const __m128i *)table);
+}
+
+// The same table in both lanes; shuffles look up within their own lane.
+__attribute__((target("avx2"))) static inline __m256i
+codec_b64_lut_avx2(const int8_t *table) {
+  return _mm256_broadcastsi128_si256(codec_b64_lut(table));
+}
+
+// Encodes the first 12 of the 16 bytes at src into 16 characters.
+__attribute__((target("ssse3"))) static inline void
+base64_encode12_ssse3(const uint8_t *src, char *dst) {
+  const __m128i shuf = codec_b64_lut(codec_b64_enc_shuf);
+  const __m128i shift_lut = codec_b64_lut(codec_b64_enc_shift);
+  __m128i in = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)src), shuf);
+  __m128i t0 = _mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00));
+  __m128i t1 = _mm_mulhi_epu16(t0, _mm_set1_epi32(0x04000040));
+  __m128i t2 = _mm_and_si128(in, _mm_set1_epi32(0x003f03f0));
+  __m128i t3 = _mm_mullo_epi16(t2, _mm_set1_epi32(0x01000010));
+  __m128i idx = _mm_or_si128(t1, t3);
+  __m128i r = _mm_subs_epu8(idx, _mm_set1_epi8(51));
+  __m128i less = _mm_cmpgt_epi8(_mm_set1_epi8(26), idx);
+  r = _mm_or_si128(r, _mm_and_si128(less, _mm_set1_epi8(13)));
+  r = _mm_add_epi8(_mm_shuffle_epi8(shift_lut, r), idx);
+  _mm_storeu_si128((__m128i *)dst, r);
+}
+
+__attribute__((target("ssse3"))) static size_t
+base64_encode_ssse3(const uint8_t *src, size_t len, char *dst) {
+  size_t i = 0;
+  char *out = dst;
+  // Each step loads 16 bytes but consumes 12, so stop while 4 spare remain.
+  for (; i + 16 <= len; i += 12, out += 16)
+    base64_encode12_ssse3(src + i, out);
+  out += base64_encode_scalar(src + i, len - i, out);
+  return out - dst;
+}
+
+__attribute__((target("avx2"))) static size_t
+base64_encode_avx2(const uint8_t *src, size_t len, char *dst) {
+  const __m256i shuf = codec_b64_lut_avx2(codec_b64_enc_shuf);
+  const __m256i shift_lut = codec_b64_lut_avx2(codec_b64_enc_shift);
+  size_t i = 0;
+  char *out = dst;
+  // Each lane takes 12 bytes from its own 16-byte load, the upper one
+  // starting 12 bytes in, so a step needs 28 bytes but consumes 24.
+  for (; i + 28 <= len; i += 24, out += 32) {
+    __m256i in = _mm256_inserti128_si256(
+        _mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)(src + i))),
+        _mm_loadu_si128((const __m128i *)(src + i + 12)), 1);
+    in = _mm256_shuffle_epi8(in, shuf);
+    __m256i t0 = _mm256_and_si256(in, _mm256_set1_epi32(0x0fc0fc00));
+    __m256i t1 = _mm256_mulhi_epu16(t0, _mm256_set1_epi32(0x04000040));
+    __m256i t2 = _mm256_and_si256(in, _mm256_set1_epi32(0x003f03f0));
+    __m256i t3 = _mm256_mullo_epi16(t2, _mm256_set1_epi32(0x01000010));
+    __m256i idx = _mm256_or_si256(t1, t3);
+    __m256i r = _mm256_subs_epu8(idx, _mm256_set1_epi8(51));
+    __m256i less = _mm256_cmpgt_epi8(_mm256_set1_epi8(26), idx);
+    r = _mm256_or_si256(r, _mm256_and_si256(less, _mm256_set1_epi8(13)));
+    r = _mm256_add_epi8(_mm256_shuffle_epi8(shift_lut, r), idx);
+    _mm256_storeu_si256((__m256i *)out, r);
+  }
+  for (; i + 16 <= len; i += 12, out += 16)
+    base64_encode12_ssse3(src + i, out);
+  out += base64_encode_scalar(src + i, len - i, out);
+  return out - dst;
+}
+
+// Decodes 16 characters into 12 bytes; returns 0 if any is not in the
+// base64 alphabet.
+__attribute__((target("ssse3"))) static inline int
+base64_decode16_ssse3(const char *src, uint8_t *dst) {
+  const __m128i lut_lo = codec_b64_lut(codec_b64_dec_lo);
+  const __m128i lut_hi = codec_b64_lut(codec_b64_dec_hi);
+  const __m128i lut_roll = codec_b64_lut(codec_b64_dec_roll);
+  const __m128i mask_2f = _mm_set1_epi8(0x2F);
+  __m128i in = _mm_loadu_si128((const __m128i *)src);
+  __m128i hi_nib = _mm_and_si128(_mm_srli_epi32(in, 4), mask_2f);
+  __m128i lo = _mm_shuffle_epi8(lut_lo, _mm_and_si128(in, mask_2f));
+  __m128i hi = _mm_shuffle_epi8(lut_hi, hi_nib);
+  if (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(lo, hi),
+                                       _mm_setzero_si128())) != 0xFFFF)
+    return 0;
+  __m128i eq_2f = _mm_cmpeq_epi8(in, mask_2f);
+  __m128i roll = _mm_shuffle_epi8(lut_roll, _mm_add_epi8(eq_2f, hi_nib));
+  __m128i sextets = _mm_add_epi8(in, roll);
+  __m128i ab = _mm_maddubs_epi16(sextets, _mm_set1_epi32(0x01400140));
+  __m128i abcd = _mm_madd_epi16(ab, _mm_set1_epi32(0x00011000));
+  uint8_t tmp[16];
+  _mm_storeu_si128((__m128i *)tmp,
+                   _mm_shuffle_epi8(abcd, codec_b64_lut(codec_b64_dec_pack)));
+  memcpy(dst, tmp, 12);
+  return 1;
+}
+
+__attribute__((target("ssse3"))) static ssize_t
+base64_decode_ssse3(const char *src, size_t len, uint8_t *dst) {
+  if (len % 4)
+    return -1;
+  size_t i = 0;
+  uint8_t *out = dst;
+  // Leave the final quantum (which may hold padding) to the scalar code.
+  for (; i + 16 < len; i += 16, out += 12) {
+    if (!base64_decode16_ssse3(src + i, out))
+      return -1;
+  }
+  ssize_t tail = base64_decode_scalar(src + i, len - i, out);
+  if (tail < 0)
+    return -1;
+  return (out - dst) + tail;
+}
+
+__attribute__((target("avx2"))) static ssize_t
+base64_decode_avx2(const char *src, size_t len, uint8_t *dst) {
+  if (len % 4)
+    return -1;
+  const __m256i lut_lo = codec_b64_lut_avx2(codec_b64_dec_lo);
+  const __m256i lut_hi = codec_b64_lut_avx2(codec_b64_dec_hi);
+  const __m256i lut_roll = codec_b64_lut_avx2(codec_b64_dec_roll);
+  const __m256i pack = codec_b64_lut_avx2(codec_b64_dec_pack);
+  const __m256i mask_2f = _mm256_set1_epi8(0x2F);
+  size_t i = 0;
+  uint8_t *out = dst;
+  for (; i + 32 < len; i += 32, out += 24) {
+    __m256i in = _mm256_loadu_si256((const __m256i *)(src + i));
+    __m256i hi_nib = _mm256_and_si256(_mm256_srli_epi32(in, 4), mask_2f);
+    __m256i lo = _mm256_shuffle_epi8(lut_lo, _mm256_and_si256(in, mask_2f));
+    __m256i hi = _mm256_shuffle_epi8(lut_hi, hi_nib);
+    if (!_mm256_testz_si256(lo, hi))
+      return -1;
+    __m256i eq_2f = _mm256_cmpeq_epi8(in, mask_2f);
+    __m256i roll =
+        _mm256_shuffle_epi8(lut_roll, _mm256_add_epi8(eq_2f, hi_nib));
+    __m256i sextets = _mm256_add_epi8(in, roll);
+    __m256i ab = _mm256_maddubs_epi16(sextets, _mm256_set1_epi32(0x01400140));
+    __m256i abcd = _mm256_madd_epi16(ab, _mm256_set1_epi32(0x00011000));
+    // Each lane packs its 12 bytes to the bottom; close the gap between the
+    // lanes with a dword permute.
+    __m256i packed = _mm256_permutevar8x32_epi32(
+        _mm256_shuffle_epi8(abcd, pack),
+        _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7));
+    uint8_t tmp[32];
+    _mm256_storeu_si256((__m256i *)tmp, packed);
+    memcpy(out, tmp, 24);
+  }
+  for (; i + 16 < len; i += 16, out += 12) {
+    if (!base64_decode16_ssse3(src + i, out))
+      return -1;
+  }
+  ssize_t tail = base64_decode_scalar(src + i, len - i, out);
+  if (tail < 0)
+    return -1;
+  return (out - dst) + tail;
+}
+
+#endif
+
+/* ---------------------------- dispatch ---------------------------- */
+
+__attribute__((constructor)) static void codec_init(void) {
+  for (int i = 0; i < 256; i++) {
+    char pair[2] = {codec_hex_digits[i >> 4], codec_hex_digits[i & 15]};
+    memcpy(&codec_hex_pairs[i], pair, 2);
+    codec_hex_values[i] = -1;
+    codec_b64_values[i] = -1;
+  }
+  for (int i = 0; i < 16; i++) {
+    codec_hex_values[(uint8_t)codec_hex_digits[i]] = i;
+    if (i >= 10)
+      codec_hex_values[(uint8_t)(codec_hex_digits[i] | 0x20)] = i;
+  }
+  for (int i = 0; i < 64; i++)
+    codec_b64_values[(uint8_t)codec_b64_alphabet[i]] = i;
+
+  codec_hex_encode_impl = hex_encode_scalar;
+  codec_hex_decode_impl = hex_decode_scalar;
+  codec_b64_encode_impl = base64_encode_scalar;
+  codec_b64_decode_impl = base64_decode_scalar;
+  codec_hex_encode_short = hex_encode_scalar;
+  codec_hex_decode_short = hex_decode_scalar;
+  codec_b64_encode_short = base64_encode_scalar;
+  codec_b64_decode_short = base64_decode_scalar;
+#ifdef CODEC_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("ssse3")) {
+    codec_hex_encode_impl = hex_encode_ssse3;
+    codec_hex_decode_impl = hex_decode_ssse3;
+    codec_b64_encode_impl = base64_encode_ssse3;
+    codec_b64_decode_impl = base64_decode_ssse3;
+    codec_impl_name = "ssse3";
+  }
+  codec_hex_encode_short = codec_hex_encode_impl;
+  codec_hex_decode_short = codec_hex_decode_impl;
+  codec_b64_encode_short = codec_b64_encode_impl;
+  codec_b64_decode_short = codec_b64_decode_impl;
+  if (__builtin_cpu_supports("avx2")) {
+    codec_hex_encode_impl = hex_encode_avx2;
+    codec_hex_decode_impl = hex_decode_avx2;
+    codec_b64_encode_impl = base64_encode_avx2;
+    codec_b64_decode_impl = base64_decode_avx2;
+    codec_impl_name = "avx2";
+  }
+#endif
+}
+
+// Writes 2 * len upper-case hex digits (no terminator); returns 2 * len.
+static inline size_t hex_encode(const uint8_t *src, size_t len, char *dst) {
+  if (len < CODEC_HEX_ENCODE_BLOCK)
+    return codec_hex_encode_short(src, len, dst);
+  return codec_hex_encode_impl(src, len, dst);
+}
+
+// Decodes len hex digits into len / 2 bytes; -1 on odd length or bad digit.
+static inline ssize_t hex_decode(const char *src, size_t len, uint8_t *dst) {
+  if (len < CODEC_HEX_DECODE_BLOCK)
+    return codec_hex_decode_short(src, len, dst);
+  return codec_hex_decode_impl(src, len, dst);
+}
+
+#define BASE64_ENCODED_LEN(n) (((n) + 2) / 3 * 4)
+
+// Writes padded standard base64 (no terminator); returns characters written.
+static inline size_t base64_encode(const uint8_t *src, size_t len, char *dst) {
+  if (len < CODEC_B64_ENCODE_BLOCK)
+    return codec_b64_encode_short(src, len, dst);
+  return codec_b64_encode_impl(src, len, dst);
+}
+
+// Decodes padded standard base64; returns bytes written or -1 if malformed.
+// dst needs room for len / 4 * 3 bytes.
+static inline ssize_t base64_decode(const char *src, size_t len,
+                                    uint8_t *dst) {
+  if (len < CODEC_B64_DECODE_BLOCK)
+    return codec_b64_decode_short(src, len, dst);
+  return codec_b64_decode_impl(src, len, dst);
+}
+
+#endif
@@ -0,0 +1,183 @@
+// Microbenchmark for codec.h: cross-checks every implementation against the
+// scalar one, then reports throughput for small (client payload sized) and
+// large buffers, next to the sprintf-per-byte loop the client used to run.
+#define _POSIX_C_SOURCE 200809L
+#include "codec.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+struct impl {
+  const char *name;
+  const char *feature;
+  size_t (*hex_enc)(const uint8_t *, size_t, char *);
+  ssize_t (*hex_dec)(const char *, size_t, uint8_t *);
+  size_t (*b64_enc)(const uint8_t *, size_t, char *);
+  ssize_t (*b64_dec)(const char *, size_t, uint8_t *);
+};
+
+static const struct impl impls[] = {
+    {"scalar", NULL, hex_encode_scalar, hex_decode_scalar,
+     base64_encode_scalar, base64_decode_scalar},
+#ifdef CODEC_X86
+    {"ssse3", "ssse3", hex_encode_ssse3, hex_decode_ssse3, base64_encode_ssse3,
+     base64_decode_ssse3},
+    {"avx2", "avx2", hex_encode_avx2, hex_decode_avx2, base64_encode_avx2,
+     base64_decode_avx2},
+#endif
+    // What hex_encode() etc. pick for the length at hand.
+    {"dispatch", NULL, hex_encode, hex_decode, base64_encode, base64_decode},
+};
+#define N_IMPLS (sizeof(impls) / sizeof(impls[0]))
+
+static int supported(const struct impl *im) {
+#ifdef CODEC_X86
+  if (im->feature && strcmp(im->feature, "ssse3") == 0)
+    return __builtin_cpu_supports("ssse3");
+  if (im->feature && strcmp(im->feature, "avx2") == 0)
+    return __builtin_cpu_supports("avx2");
+#endif
+  return im->feature == NULL;
+}
+
+static double now_sec(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static volatile size_t sink;
+
+static void sprintf_hex(const uint8_t *src, size_t len, char *dst) {
+  for (size_t i = 0; i < len; i++)
+    sprintf(dst + i * 2, "%02X", src[i]);
+}
+
+static int self_test(const uint8_t *data, size_t max_len) {
+  char *ref = malloc(max_len * 4 + 64), *got = malloc(max_len * 2 + 64);
+  uint8_t *back = malloc(max_len + 64);
+  int failures = 0;
+  for (size_t len = 0; len <= max_len; len += len < 200 ? 1 : 997) {
+    size_t rlen = hex_encode_scalar(data, len, ref);
+    size_t blen = base64_encode_scalar(data, len, ref + rlen);
+    for (size_t k = 0; k < N_IMPLS; k++) {
+      const struct impl *im = &impls[k];
+      if (!supported(im))
+        continue;
+      if (im->hex_enc(data, len, got) != rlen || memcmp(got, ref, rlen) ||
+          im->hex_dec(ref, rlen, back) != (ssize_t)len ||
+          memcmp(back, data, len)) {
+        fprintf(stderr, "%s hex mismatch at length %zu\n", im->name, len);
+        failures++;
+      }
+      if (im->b64_enc(data, len, got) != blen ||
+          memcmp(got, ref + rlen, blen) ||
+          im->b64_dec(ref + rlen, blen, back) != (ssize_t)len ||
+          memcmp(back, data, len)) {
+        fprintf(stderr, "%s base64 mismatch at length %zu\n", im->name, len);
+        failures++;
+      }
+      if (len >= 40) {
+        memcpy(got, ref, rlen);
+        got[rlen / 2] = 'g';
+        if (im->hex_dec(got, rlen, back) != -1) {
+          fprintf(stderr, "%s accepted invalid hex\n", im->name);
+          failures++;
+        }
+        memcpy(got, ref + rlen, blen);
+        got[blen / 3] = '*';
+        if (im->b64_dec(got, blen, back) != -1) {
+          fprintf(stderr, "%s accepted invalid base64\n", im->name);
+          failures++;
+        }
+      }
+    }
+  }
+  free(ref);
+  free(got);
+  free(back);
+  return failures;
+}
+
+static void bench(size_t len, size_t total) {
+  size_t reps = total / len;
+  uint8_t *src = malloc(len + 64);
+  char *enc = malloc(len * 2 + 64);
+  uint8_t *dec = malloc(len + 64);
+  for (size_t i = 0; i < len; i++)
+    src[i] = (uint8_t)rand();
+
+  printf("\n%zu-byte buffers, %zu MB per run (MB/s of raw bytes)\n", len,
+         total >> 20);
+  printf("%-8s %12s %12s %12s %12s\n", "impl", "hex enc", "hex dec",
+         "b64 enc", "b64 dec");
+
+  double t = now_sec();
+  size_t sprintf_reps = reps / 16 ? reps / 16 : 1;
+  for (size_t r = 0; r < sprintf_reps; r++)
+    sprintf_hex(src, len, enc);
+  t = now_sec() - t;
+  printf("%-8s %12.1f %12s %12s %12s\n", "sprintf",
+         sprintf_reps * len / t / 1e6, "-", "-", "-");
+
+  for (size_t k = 0; k < N_IMPLS; k++) {
+    const struct impl *im = &impls[k];
+    if (!supported(im))
+      continue;
+    double mbs[4];
+    int dispatch = k == N_IMPLS - 1;
+    size_t hex_len = im->hex_enc(src, len, enc);
+    for (int op = 0; op < 4; op++) {
+      double start = now_sec();
+      for (size_t r = 0; r < reps; r++) {
+        switch (op) {
+        // The dispatch row calls the inline entry points the way client.c
+        // does, not through a pointer to them.
+        case 0:
+          sink += dispatch ? hex_encode(src, len, enc)
+                           : im->hex_enc(src, len, enc);
+          break;
+        case 1:
+          sink += dispatch ? hex_decode(enc, hex_len, dec)
+                           : im->hex_dec(enc, hex_len, dec);
+          break;
+        case 2:
+          sink += dispatch ? base64_encode(src, len, enc)
+                           : im->b64_enc(src, len, enc);
+          break;
+        case 3:
+          sink += dispatch ? base64_decode(enc, BASE64_ENCODED_LEN(len), dec)
+                           : im->b64_dec(enc, BASE64_ENCODED_LEN(len), dec);
+          break;
+        }
+      }
+      mbs[op] = reps * len / (now_sec() - start) / 1e6;
+      if (op == 1)
+        im->b64_enc(src, len, enc);
+    }
+    printf("%-8s %12.1f %12.1f %12.1f %12.1f\n", im->name, mbs[0], mbs[1],
+           mbs[2], mbs[3]);
+  }
+  free(src);
+  free(enc);
+  free(dec);
+}
+
+int main(int argc, char *argv[]) {
+  size_t total = (argc > 1 ? strtoull(argv[1], NULL, 10) : 256) << 20;
+  uint8_t data[8192];
+  srand(1);
+  for (size_t i = 0; i < sizeof(data); i++)
+    data[i] = (uint8_t)rand();
+  int failures = self_test(data, sizeof(data));
+  printf("dispatch: %s, self test: %s\n", codec_impl_name,
+         failures ? "FAILED" : "ok");
+  if (failures)
+    return 1;
+
+  bench(16, total / 4);
+  bench(500, total);
+  bench(64 * 1024, total);
+  return 0;
+}
@@ -0,0 +1,290 @@
+#define _POSIX_C_SOURCE 200809L
+#include "clientlog.h"
+#include "codec.h"
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+struct filter {
+  int by_sender;
+  uint32_t ip;
+  uint16_t port; // network order, 0 matches any port
+  uint64_t from_ns;
+  uint64_t to_ns;
+  int show_time;
+  int count_only;
+};
+
+static uint64_t matched = 0;
+
+static uint64_t parse_time(const char *str) {
+  double secs = strtod(str, NULL);
+  return secs <= 0 ? 0 : (uint64_t)(secs * 1e9);
+}
+
+static int parse_sender(const char *str, struct filter *f) {
+  char host[INET_ADDRSTRLEN];
+  const char *colon = strchr(str, ':');
+  size_t host_len = colon ? (size_t)(colon - str) : strlen(str);
+  if (host_len >= sizeof(host))
+    return -1;
+  memcpy(host, str, host_len);
+  host[host_len] = '\0';
+  struct in_addr addr;
+  if (inet_pton(AF_INET, host, &addr) <= 0)
+    return -1;
+  f->by_sender = 1;
+  f->ip = addr.s_addr;
+  f->port = colon ? htons(atoi(colon + 1)) : 0;
+  return 0;
+}
+
+static int index_may_match(const struct clog_index *idx,
+                           const struct filter *f) {
+  if (idx->count == 0 || idx->max_ns < f->from_ns || idx->min_ns > f->to_ns)
+    return 0;
+  uint64_t bloom[4];
+  memcpy(bloom, idx->sender_bloom, sizeof(bloom));
+  if (f->by_sender && !clog_bloom_test(bloom, f->ip, f->port))
+    return 0;
+  return 1;
+}
+
+static void emit(const struct clog_record *rec, const char *payload,
+                 const struct filter *f) {
+  if (rec->recv_ns < f->from_ns || rec->recv_ns > f->to_ns)
+    return;
+  if (f->by_sender && (rec->sender_ip != f->ip ||
+                       (f->port != 0 && rec->sender_port != f->port)))
+    return;
+  matched++;
+  if (f->count_only)
+    return;
+
+  struct in_addr ip_addr;
+  ip_addr.s_addr = rec->sender_ip;
+  char ip_str[INET_ADDRSTRLEN];
+  inet_ntop(AF_INET, &ip_addr, ip_str, sizeof(ip_str));
+  if (f->show_time)
+    printf("%llu.%09llu ", (unsigned long long)(rec->recv_ns / 1000000000ull),
+           (unsigned long long)(rec->recv_ns % 1000000000ull));
+  int len = rec->payload_len;
+  static char hex[2 * UINT16_MAX];
+  if (rec->flags & CLOG_FLAG_HEX) {
+    len = hex_encode((const uint8_t *)payload, len, hex);
+    payload = hex;
+  }
+  printf("%-15s%-10u%.*s\n", ip_str, ntohs(rec->sender_port), len, payload);
+}
+
+// Walks blocks in [pos, end), rendering up to `limit` records. Returns the
+// offset where it stopped; a torn record at the end of a crashed log ends the
+// walk early.
+static size_t scan(const char *base, size_t pos, size_t end, uint64_t limit,
+                   const struct filter *f) {
+  while (pos < end && limit > 0) {
+    if (base[pos] == CLOG_TAG_RECORD) {
+      struct clog_record rec;
+      if (end - pos < sizeof(rec))
+        return end;
+      memcpy(&rec, base + pos, sizeof(rec));
+      if (end - pos - sizeof(rec) < rec.payload_len)
+        return end;
+      emit(&rec, base + pos + sizeof(rec), f);
+      pos += sizeof(rec) + rec.payload_len;
+      limit--;
+    } else if (base[pos] == CLOG_TAG_INDEX) {
+      pos += sizeof(struct clog_index);
+    } else {
+      fprintf(stderr, "corrupt block at offset %zu\n", pos);
+      return end;
+    }
+  }
+  return pos;
+}
+
+// Rotated segments may be gzipped by the client; those are inflated into
+// memory, everything else is mapped.
+static const char *load_log(const char *path, size_t *size, int *mapped) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    perror("open");
+    exit(EXIT_FAILURE);
+  }
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    perror("fstat");
+    exit(EXIT_FAILURE);
+  }
+  unsigned char magic[2] = {0};
+  if (pread(fd, magic, sizeof(magic), 0) == 2 && magic[0] == 0x1f &&
+      magic[1] == 0x8b) {
+    gzFile gz = gzdopen(fd, "rb");
+    size_t cap = st.st_size * 4 + 4096, len = 0;
+    char *buf = malloc(cap);
+    int n = 0;
+    while (gz && buf && (n = gzread(gz, buf + len, cap - len)) > 0) {
+      len += n;
+      if (len == cap) {
+        char *grown = realloc(buf, cap *= 2);
+        if (grown == NULL)
+          free(buf);
+        buf = grown;
+      }
+    }
+    if (!gz || !buf || n < 0) {
+      fprintf(stderr, "%s: cannot decompress\n", path);
+      exit(EXIT_FAILURE);
+    }
+    gzclose(gz);
+    *size = len;
+    *mapped = 0;
+    return buf;
+  }
+
+  *size = st.st_size;
+  *mapped = 1;
+  if (*size == 0) {
+    close(fd);
+    return "";
+  }
+  const char *base = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (base == MAP_FAILED) {
+    perror("mmap");
+    exit(EXIT_FAILURE);
+  }
+  close(fd);
+  return base;
+}
+
+static void usage(const char *prog) {
+  fprintf(stderr,
+          "Usage: %s [options] <binary log file, optionally gzipped>\n"
+          "  -s <ip>[:<port>]  only messages from this sender\n"
+          "  -a <secs>         only messages received at or after this unix "
+          "time\n"
+          "  -b <secs>         only messages received at or before this unix "
+          "time\n"
+          "  -t                prefix each line with its receive time\n"
+          "  -c                print the number of matching messages only\n",
+          prog);
+  exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+  struct filter f = {0};
+  f.to_ns = UINT64_MAX;
+  int c;
+  while ((c = getopt(argc, argv, "s:a:b:tc")) != -1) {
+    switch (c) {
+    case 's':
+      if (parse_sender(optarg, &f) < 0)
+        usage(argv[0]);
+      break;
+    case 'a':
+      f.from_ns = parse_time(optarg);
+      break;
+    case 'b':
+      f.to_ns = parse_time(optarg);
+      break;
+    case 't':
+      f.show_time = 1;
+      break;
+    case 'c':
+      f.count_only = 1;
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+  if (argc - optind != 1)
+    usage(argv[0]);
+
+  size_t size;
+  int mapped;
+  const char *base = load_log(argv[optind], &size, &mapped);
+  if (size < CLOG_MAGIC_LEN || memcmp(base, CLOG_MAGIC, CLOG_MAGIC_LEN) != 0) {
+    fprintf(stderr, "%s: not a binary client log\n", argv[optind]);
+    exit(EXIT_FAILURE);
+  }
+
+  static char outbuf[1 << 20];
+  setvbuf(stdout, outbuf, _IOFBF, sizeof(outbuf));
+
+  struct clog_footer footer;
+  int have_footer = 0;
+  if (size >= CLOG_MAGIC_LEN + sizeof(footer)) {
+    memcpy(&footer, base + size - sizeof(footer), sizeof(footer));
+    have_footer = memcmp(footer.magic, CLOG_FOOTER_MAGIC, 8) == 0;
+  }
+
+  if (!have_footer) {
+    // Unclean shutdown: no way to find the index chain, fall back to a scan.
+    scan(base, CLOG_MAGIC_LEN, size, UINT64_MAX, &f);
+  } else {
+    size_t end = size - sizeof(footer);
+    size_t n_idx = 0, cap = 64;
+    uint64_t *chain = malloc(cap * sizeof(*chain));
+    if (chain == NULL) {
+      perror("malloc");
+      exit(EXIT_FAILURE);
+    }
+    for (uint64_t at = footer.last_index; at != CLOG_NO_INDEX;) {
+      struct clog_index idx;
+      int ok = at <= end && end - at >= sizeof(idx) &&
+               base[at] == CLOG_TAG_INDEX;
+      if (ok) {
+        memcpy(&idx, base + at, sizeof(idx));
+        // Indexes are appended, so each links back to an earlier one; any
+        // other link would send the walk around in circles.
+        ok = idx.prev_index == CLOG_NO_INDEX || idx.prev_index < at;
+      }
+      if (!ok) {
+        fprintf(stderr, "corrupt index chain at offset %llu\n",
+                (unsigned long long)at);
+        exit(EXIT_FAILURE);
+      }
+      if (n_idx == cap) {
+        uint64_t *grown = realloc(chain, cap * 2 * sizeof(*chain));
+        if (grown == NULL) {
+          perror("realloc");
+          exit(EXIT_FAILURE);
+        }
+        chain = grown;
+        cap *= 2;
+      }
+      chain[n_idx++] = at;
+      at = idx.prev_index;
+    }
+    for (size_t i = n_idx; i-- > 0;) {
+      struct clog_index idx;
+      memcpy(&idx, base + chain[i], sizeof(idx));
+      if (!index_may_match(&idx, &f))
+        continue;
+      if (f.count_only && !f.by_sender && idx.min_ns >= f.from_ns &&
+          idx.max_ns <= f.to_ns) {
+        matched += idx.count;
+        continue;
+      }
+      scan(base, idx.chunk_offset, chain[i], idx.count, &f);
+    }
+    free(chain);
+  }
+
+  if (f.count_only)
+    printf("%llu\n", (unsigned long long)matched);
+  fflush(stdout);
+  if (!mapped)
+    free((void *)base);
+  else if (size > 0)
+    munmap((void *)base, size);
+  return 0;
+}
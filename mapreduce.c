@@ -1,243 +1,1905 @@
-#include "interface.h"
+#define _GNU_SOURCE
+#include "mapreduce.h"
+#include "psort.h"
 #include "tests.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
 #include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
 
-#define MAX_INTERMEDIATE_KV (MAX_DATA_SIZE * MAX_THREADS)
+#define ARENA_CHUNK_SIZE (64 * 1024)
+// Below this many tuples radix sort hands over to multikey quicksort, and
+// multikey quicksort to insertion sort.
+#define RADIX_CUTOFF 64
+#define INSERTION_CUTOFF 12
+// Map tasks handed to each pool worker per job; more, smaller tasks let
+// stealing even out records that are much costlier to map than others.
+#define MAP_TASKS_PER_WORKER 16
+// Pairs a partition may collect before the combiner first runs over it.
+#define COMBINE_BATCH 4096
+// Write buffer for spilling, and read buffer per run while merging.
+#define SPILL_BUFFER_SIZE (256 * 1024)
+#define RUN_BUFFER_SIZE (64 * 1024)
+// Bytes of a file source per map task unless the caller picks a size.
+#define SOURCE_SPLIT_SIZE (1024 * 1024)
+// Tries a task gets in multi-process mode before the job gives up.
+#define TASK_ATTEMPTS 3
+// Seconds a task may run in multi-process mode unless the caller picks.
+#define TASK_TIMEOUT 600
+// In pipelined mode, runs a partition collects before they are merged.
+#define PIPELINE_FAN_IN 8
 
-static struct {
-  char key[MAX_KEY_SIZE];
-  char value[MAX_VALUE_SIZE];
-} intermediate_buffer[MAX_INTERMEDIATE_KV];
-static size_t intermediate_count = 0;
-static pthread_mutex_t intermediate_mutex = PTHREAD_MUTEX_INITIALIZER;
+// Emitted strings are packed back to back into chunks that never move, so
+// short keys and values only take the bytes they need and a pair is just two
+// pointers into its buffer's arena.
+struct arena_chunk {
+  struct arena_chunk *next;
+  size_t used;
+  size_t cap;
+  char data[];
+};
+
+struct arena {
+  struct arena_chunk *head;
+};
 
-#define MAX_FINAL_KV (MAX_DATA_SIZE * MAX_THREADS)
+struct kv_pair {
+  const char *key;
+  const char *value;
+};
 
-static struct {
-  char key[MAX_KEY_SIZE];
-  char value[MAX_VALUE_SIZE];
-} final_buffer[MAX_FINAL_KV];
-static size_t final_count = 0;
-static pthread_mutex_t final_mutex = PTHREAD_MUTEX_INITIALIZER;
+// What a partition is actually sorted by: the first 8 key bytes big-endian,
+// so integer order is string order on them, and the key hash, which tells
+// apart most keys that share a prefix. The strings themselves are only read
+// on prefix ties; a partition holds fewer than 2^32 pairs.
+struct sort_tuple {
+  uint64_t prefix;
+  uint32_t hash;
+  uint32_t idx;
+};
 
-struct map_task_arg {
-  const struct mr_in_kv *kv_lst;
-  size_t start_idx;
-  size_t end_idx;
+// Pairs emitted by one map or reduce thread. Each thread appends to its own
+// buffer without locking; mr_exec gathers them once the phase has joined.
+struct kv_buffer {
+  struct kv_pair *pairs;
+  size_t count;
+  size_t cap;
+  size_t combine_at;
+  size_t bytes;
+  struct arena arena;
+};
+
+// A sorted run of one partition in a worker's spill file. Records are a
+// spill_record header followed by the key and the value, each with its NUL.
+struct spill_run {
+  size_t part;
+  off_t start;
+  off_t end;
+};
+
+struct spill_record {
+  uint16_t key_len;
+  uint16_t value_len;
+};
+
+// The longest record a run can hold, and so the least a merge can buffer per
+// run.
+#define RUN_RECORD_MAX                                                         \
+  (sizeof(struct spill_record) + MAX_KEY_SIZE + MAX_VALUE_SIZE)
+
+// Map output is kept per pool worker rather than per task, hash partitioned
+// into one buffer per reducer, so the shuffle is just each reduce task
+// collecting its partition from every worker.
+struct map_output {
+  void (*combine)(const struct mr_out_kv *);
+  struct kv_buffer *parts;
+  size_t part_count;
+  enum mr_sort sort;
+  int failed;
+  // Spill mode: once `bytes` of pairs are buffered past `budget`, every
+  // partition is sorted and appended as a run to the worker's spill file.
+  size_t budget;
+  size_t bytes;
+  const char *spill_dir;
+  int spill_fd;
+  off_t spill_size;
+  struct spill_run *runs;
+  size_t run_count;
+  size_t run_cap;
+};
+
+// Per-worker counters behind mr_stats; only the owning worker writes them.
+struct worker_stats {
+  double busy;
+  double sort;
+  double group;
+  double reduce;
+  size_t records;
+  size_t pairs;
+  size_t bytes;
+  size_t groups;
+  size_t values;
+};
+
+static __thread struct map_output *current_map;
+static __thread int combining;
+static __thread struct kv_buffer *final_buffer;
+// Set while a task of a job that collects stats runs.
+static __thread struct worker_stats *current_stats;
+static __thread void (*current_map_fn)(const struct mr_in_kv *);
+
+// A sorted run published by a map task in pipelined mode. It owns the
+// strings its pairs point to. Runs a map task publishes are level 0, and a
+// merge of PIPELINE_FAN_IN runs of one level is a run of the next.
+struct pipe_run {
+  struct kv_pair *pairs;
+  size_t count;
+  struct arena arena;
+  size_t level;
+};
+
+struct pipe_part {
+  pthread_mutex_t lock;
+  struct pipe_run *runs;
+  size_t count;
+  size_t cap;
+};
+
+struct map_job {
+  const struct mr_source *source;
   void (*map)(const struct mr_in_kv *);
-  ;
+  struct map_output *outputs;
+  struct pipe_part *pipe; // per partition, NULL unless pipelined
+  struct worker_stats *stats; // per worker, NULL unless collecting stats
+};
+
+// mr_input as a source: each split is a chunk of the array.
+struct array_source {
+  const struct mr_in_kv *kv_lst;
+  size_t count;
+  size_t chunk;
 };
 
-typedef struct {
-  char key[MAX_KEY_SIZE];
-  char **values;
-  size_t value_count;
-} key_group;
+// A mapped file of delimited records, see mr_source_open.
+struct file_source {
+  const char *data;
+  size_t size;
+  size_t split_size;
+  char delim;
+};
 
-struct reduce_task_arg {
-  key_group *groups;
-  size_t start_idx;
-  size_t end_idx;
+struct reduce_job {
+  struct map_output *maps;
+  size_t map_count;
   void (*reduce)(const struct mr_out_kv *);
+  struct kv_buffer *outs;
+  enum mr_sort sort;
+  int failed;
+  struct pipe_part *pipe;
+  struct worker_stats *stats;
+  // Spill mode: what one merge may buffer, and where it can put runs it has
+  // merged on the way.
+  size_t budget;
+  const char *spill_dir;
 };
 
-void *map_thread(void *arg) {
-  struct map_task_arg *task = (struct map_task_arg *)arg;
-  for (size_t i = task->start_idx; i < task->end_idx; ++i) {
-    task->map(&(task->kv_lst[i]));
+static double now_sec(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Seconds since *mark, which moves up to now.
+static double lap(double *mark) {
+  double now = now_sec(), sec = now - *mark;
+  *mark = now;
+  return sec;
+}
+
+// Where the calling reduce work is counted, NULL when stats are off or the
+// work is a combiner's.
+static struct worker_stats *reduce_stats(void) {
+  return combining ? NULL : current_stats;
+}
+
+// Calls fn on one group, timing it when st is set.
+static void call_reduce(void (*fn)(const struct mr_out_kv *),
+                        const struct mr_out_kv *kv, struct worker_stats *st,
+                        double *fn_sec) {
+  double start = st != NULL ? now_sec() : 0;
+  fn(kv);
+  if (st != NULL) {
+    *fn_sec += now_sec() - start;
+    st->groups++;
+    st->values += kv->count;
+  }
+}
+
+static char *arena_alloc(struct arena *a, size_t size) {
+  struct arena_chunk *c = a->head;
+  if (c == NULL || c->cap - c->used < size) {
+    size_t cap = size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE;
+    c = malloc(sizeof(*c) + cap);
+    if (c == NULL)
+      return NULL;
+    c->next = a->head;
+    c->used = 0;
+    c->cap = cap;
+    a->head = c;
+  }
+  char *p = c->data + c->used;
+  c->used += size;
+  return p;
+}
+
+static void arena_free(struct arena *a) {
+  while (a->head != NULL) {
+    struct arena_chunk *next = a->head->next;
+    free(a->head);
+    a->head = next;
+  }
+}
+
+// Moves every chunk of src over to dst.
+static void arena_splice(struct arena *dst, struct arena *src) {
+  if (src->head == NULL)
+    return;
+  struct arena_chunk *tail = src->head;
+  while (tail->next != NULL)
+    tail = tail->next;
+  tail->next = dst->head;
+  dst->head = src->head;
+  src->head = NULL;
+}
+
+static void kv_buffer_free(struct kv_buffer *buf) {
+  free(buf->pairs);
+  arena_free(&buf->arena);
+  buf->pairs = NULL;
+  buf->count = buf->cap = 0;
+  buf->bytes = 0;
+}
+
+// FNV-1a over the key as it will be stored, i.e. truncated to MAX_KEY_SIZE - 1.
+static uint32_t key_hash(const char *key) {
+  uint32_t h = 2166136261u;
+  for (size_t i = 0; i < MAX_KEY_SIZE - 1 && key[i] != '\0'; i++) {
+    h ^= (unsigned char)key[i];
+    h *= 16777619u;
+  }
+  return h;
+}
+
+static uint64_t key_prefix(const char *key) {
+  uint64_t prefix = 0;
+  int ended = 0;
+  for (int i = 0; i < 8; i++) {
+    ended = ended || key[i] == '\0';
+    prefix = prefix << 8 | (ended ? 0 : (unsigned char)key[i]);
+  }
+  return prefix;
+}
+
+// Equal prefixes with a NUL in the last byte mean both keys end inside the
+// prefix and are equal; otherwise both continue past it.
+static int compare_tuples(const void *a, const void *b, void *arg) {
+  const struct sort_tuple *ta = a;
+  const struct sort_tuple *tb = b;
+  if (ta->prefix != tb->prefix)
+    return ta->prefix < tb->prefix ? -1 : 1;
+  if ((ta->prefix & 0xff) == 0)
+    return 0;
+  const struct kv_pair *pairs = arg;
+  return strcmp(pairs[ta->idx].key + 8, pairs[tb->idx].key + 8);
+}
+
+static int same_key(const struct sort_tuple *a, const struct sort_tuple *b,
+                    const struct kv_pair *pairs) {
+  if (a->prefix != b->prefix || a->hash != b->hash)
+    return 0;
+  return (a->prefix & 0xff) == 0 ||
+         strcmp(pairs[a->idx].key + 8, pairs[b->idx].key + 8) == 0;
+}
+
+// Byte `depth` of a tuple's key. Only called once bytes 0..depth-1 are known
+// to be non-NUL, so it never reads past the end of the key.
+static unsigned char tuple_char(const struct sort_tuple *t,
+                                const struct kv_pair *pairs, size_t depth) {
+  if (depth < 8)
+    return t->prefix >> (56 - 8 * depth) & 0xff;
+  return (unsigned char)pairs[t->idx].key[depth];
+}
+
+// Compares two keys known to agree on their first `depth` bytes.
+static int compare_from(const struct sort_tuple *a, const struct sort_tuple *b,
+                        const struct kv_pair *pairs, size_t depth) {
+  for (; depth < MAX_KEY_SIZE; depth++) {
+    int ca = tuple_char(a, pairs, depth), cb = tuple_char(b, pairs, depth);
+    if (ca != cb || ca == 0)
+      return ca - cb;
+  }
+  return 0;
+}
+
+static void swap_tuples(struct sort_tuple *a, struct sort_tuple *b) {
+  struct sort_tuple t = *a;
+  *a = *b;
+  *b = t;
+}
+
+// Bentley-Sedgewick multikey quicksort: three-way partition on one key byte,
+// then only the middle part moves on to the next byte.
+static void multikey_sort(struct sort_tuple *t, size_t n,
+                          const struct kv_pair *pairs, size_t depth) {
+  while (n > INSERTION_CUTOFF && depth < MAX_KEY_SIZE) {
+    int a = tuple_char(&t[0], pairs, depth);
+    int b = tuple_char(&t[n / 2], pairs, depth);
+    int c = tuple_char(&t[n - 1], pairs, depth);
+    int pivot = a < b ? (b < c ? b : (a < c ? c : a))
+                      : (a < c ? a : (b < c ? c : b));
+    size_t lt = 0, i = 0, gt = n;
+    while (i < gt) {
+      int ch = tuple_char(&t[i], pairs, depth);
+      if (ch < pivot)
+        swap_tuples(&t[lt++], &t[i++]);
+      else if (ch > pivot)
+        swap_tuples(&t[i], &t[--gt]);
+      else
+        i++;
+    }
+    multikey_sort(t, lt, pairs, depth);
+    multikey_sort(t + gt, n - gt, pairs, depth);
+    if (pivot == 0)
+      return;
+    t += lt;
+    n = gt - lt;
+    depth++;
+  }
+  for (size_t i = 1; i < n; i++) {
+    size_t j = i;
+    while (j > 0 && compare_from(&t[j - 1], &t[j], pairs, depth) > 0) {
+      swap_tuples(&t[j - 1], &t[j]);
+      j--;
+    }
+  }
+}
+
+// MSD radix sort, one key byte per pass, with tmp as the scatter buffer.
+// Bucket 0 holds keys that ended and are therefore equal.
+static void radix_sort(struct sort_tuple *t, struct sort_tuple *tmp, size_t n,
+                       const struct kv_pair *pairs, size_t depth) {
+  if (n < RADIX_CUTOFF || depth >= MAX_KEY_SIZE) {
+    multikey_sort(t, n, pairs, depth);
+    return;
   }
-  return NULL;
+  size_t count[256] = {0};
+  for (size_t i = 0; i < n; i++)
+    count[tuple_char(&t[i], pairs, depth)]++;
+  size_t start[256];
+  size_t pos = 0;
+  for (int c = 0; c < 256; c++) {
+    start[c] = pos;
+    pos += count[c];
+  }
+  for (size_t i = 0; i < n; i++)
+    tmp[start[tuple_char(&t[i], pairs, depth)]++] = t[i];
+  memcpy(t, tmp, n * sizeof(*t));
+  pos = count[0];
+  for (int c = 1; c < 256; c++) {
+    if (count[c] > 1)
+      radix_sort(t + pos, tmp, count[c], pairs, depth + 1);
+    pos += count[c];
+  }
+}
+
+static int sort_tuples(struct sort_tuple *tuples, size_t count,
+                       const struct kv_pair *pairs, enum mr_sort sort) {
+  if (sort == MR_SORT_MULTIKEY) {
+    multikey_sort(tuples, count, pairs, 0);
+  } else if (sort == MR_SORT_QSORT) {
+    qsort_r(tuples, count, sizeof(tuples[0]), compare_tuples, (void *)pairs);
+  } else {
+    struct sort_tuple *tmp = malloc((count ? count : 1) * sizeof(*tmp));
+    if (tmp == NULL)
+      return -1;
+    radix_sort(tuples, tmp, count, pairs, 0);
+    free(tmp);
+  }
+  return 0;
+}
+
+// Returns the pairs' tuples sorted by key, or NULL when out of memory.
+static struct sort_tuple *sorted_tuples(const struct kv_pair *pairs,
+                                        size_t count, enum mr_sort sort) {
+  if (count > UINT32_MAX)
+    return NULL;
+  struct sort_tuple *tuples = malloc((count ? count : 1) * sizeof(*tuples));
+  if (tuples == NULL)
+    return NULL;
+  for (size_t i = 0; i < count; ++i) {
+    tuples[i].prefix = key_prefix(pairs[i].key);
+    tuples[i].hash = key_hash(pairs[i].key);
+    tuples[i].idx = i;
+  }
+  if (sort_tuples(tuples, count, pairs, sort) != 0) {
+    free(tuples);
+    return NULL;
+  }
+  return tuples;
+}
+
+// One group's values laid out the way mr_out_kv wants them, reused from
+// group to group.
+struct value_scratch {
+  char (*values)[MAX_VALUE_SIZE];
+  size_t cap;
+};
+
+static int scratch_reserve(struct value_scratch *s, size_t count) {
+  if (count <= s->cap)
+    return 0;
+  size_t cap = s->cap * 2 > count ? s->cap * 2 : count;
+  void *grown = realloc(s->values, cap * MAX_VALUE_SIZE);
+  if (grown == NULL)
+    return -1;
+  s->values = grown;
+  s->cap = cap;
+  return 0;
 }
 
-void *reduce_thread(void *arg) {
-  struct reduce_task_arg *task = (struct reduce_task_arg *)arg;
+// Sorts pairs by key and calls fn once per key with all of its values. Groups
+// are runs of the sorted tuples; the only copy is of each value into one
+// scratch array reused across groups, since mr_out_kv wants them contiguous.
+static int reduce_pairs(const struct kv_pair *pairs, size_t count,
+                        void (*fn)(const struct mr_out_kv *),
+                        enum mr_sort sort) {
+  struct worker_stats *st = reduce_stats();
+  double start = st != NULL ? now_sec() : 0, fn_sec = 0;
+  struct sort_tuple *tuples = sorted_tuples(pairs, count, sort);
+  if (tuples == NULL)
+    return -1;
+  double sorted = st != NULL ? now_sec() : 0;
+
+  struct value_scratch scratch = {0};
+  size_t idx = 0;
+  while (idx < count) {
+    size_t j = idx + 1;
+    while (j < count && same_key(&tuples[idx], &tuples[j], pairs)) {
+      j++;
+    }
+    if (scratch_reserve(&scratch, j - idx) != 0)
+      break;
 
-  for (size_t i = task->start_idx; i < task->end_idx; ++i) {
     struct mr_out_kv outkv;
-    strncpy(outkv.key, task->groups[i].key, MAX_KEY_SIZE);
-    outkv.key[MAX_KEY_SIZE - 1] = '\0';
-    outkv.count = task->groups[i].value_count;
-    outkv.value = malloc(outkv.count * MAX_VALUE_SIZE);
+    strcpy(outkv.key, pairs[tuples[idx].idx].key);
+    outkv.value = scratch.values;
+    outkv.count = j - idx;
     for (size_t k = 0; k < outkv.count; ++k) {
-      strncpy(outkv.value[k], task->groups[i].values[k], MAX_VALUE_SIZE);
-      outkv.value[k][MAX_VALUE_SIZE - 1] = '\0';
+      const char *v = pairs[tuples[idx + k].idx].value;
+      memcpy(scratch.values[k], v, strlen(v) + 1);
     }
-    task->reduce(&outkv);
-    free(outkv.value);
+    call_reduce(fn, &outkv, st, &fn_sec);
+    idx = j;
   }
-  return NULL;
+  free(scratch.values);
+  free(tuples);
+  if (st != NULL) {
+    st->sort += sorted - start;
+    st->group += now_sec() - sorted - fn_sec;
+    st->reduce += fn_sec;
+  }
+  return idx == count ? 0 : -1;
 }
 
-int mr_emit_i(const char *key, const char *value) {
-  pthread_mutex_lock(&intermediate_mutex);
-  if (intermediate_count >= MAX_INTERMEDIATE_KV) {
-    pthread_mutex_unlock(&intermediate_mutex);
+static int write_all(int fd, const char *buf, size_t len) {
+  while (len > 0) {
+    ssize_t n = write(fd, buf, len);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return -1;
+    buf += n;
+    len -= n;
+  }
+  return 0;
+}
+
+// Buffers records in the spill_record format on their way to a file.
+struct run_writer {
+  int fd;
+  off_t size; // bytes written to fd so far
+  char *buf;
+  size_t used;
+  size_t cap;
+};
+
+static off_t writer_offset(const struct run_writer *w) {
+  return w->size + w->used;
+}
+
+static int writer_flush(struct run_writer *w) {
+  int ret = write_all(w->fd, w->buf, w->used);
+  w->size += w->used;
+  w->used = 0;
+  return ret;
+}
+
+static int writer_put(struct run_writer *w, const char *key,
+                      const char *value) {
+  struct spill_record rec = {strlen(key), strlen(value)};
+  size_t len = sizeof(rec) + rec.key_len + rec.value_len + 2;
+  if (w->used + len > w->cap && writer_flush(w) != 0)
     return -1;
+  memcpy(w->buf + w->used, &rec, sizeof(rec));
+  memcpy(w->buf + w->used + sizeof(rec), key, rec.key_len + 1);
+  memcpy(w->buf + w->used + sizeof(rec) + rec.key_len + 1, value,
+         rec.value_len + 1);
+  w->used += len;
+  return 0;
+}
+
+// Sorts every partition of a worker's buffered output, appends each as a
+// run to the worker's spill file and drops the buffers. The file is created
+// in spill_dir on first use and unlinked at once, so it lives only as long
+// as its descriptor.
+static int spill_output(struct map_output *out) {
+  if (out->spill_fd < 0) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/mr-spill-XXXXXX", out->spill_dir);
+    out->spill_fd = mkstemp(path);
+    if (out->spill_fd < 0)
+      return -1;
+    unlink(path);
+  }
+  struct run_writer w = {out->spill_fd, out->spill_size,
+                         malloc(SPILL_BUFFER_SIZE), 0, SPILL_BUFFER_SIZE};
+  if (w.buf == NULL)
+    return -1;
+
+  int ret = 0;
+  for (size_t p = 0; p < out->part_count && ret == 0; ++p) {
+    struct kv_buffer *part = &out->parts[p];
+    if (part->count == 0)
+      continue;
+    if (out->run_count == out->run_cap) {
+      size_t cap = out->run_cap ? out->run_cap * 2 : 16;
+      struct spill_run *runs = realloc(out->runs, cap * sizeof(*runs));
+      if (runs == NULL) {
+        ret = -1;
+        break;
+      }
+      out->runs = runs;
+      out->run_cap = cap;
+    }
+    struct sort_tuple *tuples = sorted_tuples(part->pairs, part->count,
+                                              out->sort);
+    if (tuples == NULL) {
+      ret = -1;
+      break;
+    }
+
+    off_t start = writer_offset(&w);
+    for (size_t i = 0; i < part->count && ret == 0; ++i) {
+      const struct kv_pair *kv = &part->pairs[tuples[i].idx];
+      ret = writer_put(&w, kv->key, kv->value);
+    }
+    free(tuples);
+    out->runs[out->run_count++] =
+        (struct spill_run){p, start, writer_offset(&w)};
+    kv_buffer_free(part);
+  }
+  if (ret == 0)
+    ret = writer_flush(&w);
+  out->spill_size = writer_offset(&w);
+  free(w.buf);
+  out->bytes = 0;
+  return ret;
+}
+
+// Reads one sorted run a record at a time for the k-way merge: a spilled
+// run, or pairs in memory that are in order or are put in order by tuples.
+struct run_cursor {
+  const char *key;
+  const char *value;
+  const struct kv_pair *pairs;
+  const struct sort_tuple *tuples;
+  size_t pos;
+  size_t count;
+  int fd;
+  off_t next;
+  off_t end;
+  char *buf;
+  size_t cap;
+  size_t len;
+  size_t off;
+};
+
+// Returns 1 and points key/value at the next record, 0 at the end of the
+// run, -1 on a read error or a corrupt record.
+static int cursor_next(struct run_cursor *c) {
+  if (c->buf == NULL) {
+    if (c->pos == c->count)
+      return 0;
+    size_t idx = c->tuples != NULL ? c->tuples[c->pos].idx : c->pos;
+    const struct kv_pair *kv = &c->pairs[idx];
+    c->pos++;
+    c->key = kv->key;
+    c->value = kv->value;
+    return 1;
+  }
+
+  struct spill_record rec;
+  size_t have = c->len - c->off;
+  size_t need = sizeof(rec);
+  if (have >= sizeof(rec)) {
+    memcpy(&rec, c->buf + c->off, sizeof(rec));
+    need += rec.key_len + rec.value_len + 2;
+  }
+  if (have < need) {
+    memmove(c->buf, c->buf + c->off, have);
+    c->len = have;
+    c->off = 0;
+    while (c->len < c->cap && c->next < c->end) {
+      size_t want = c->cap - c->len;
+      if ((off_t)want > c->end - c->next)
+        want = c->end - c->next;
+      ssize_t n = pread(c->fd, c->buf + c->len, want, c->next);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        return -1;
+      c->len += n;
+      c->next += n;
+    }
+    have = c->len;
+    if (have == 0)
+      return 0;
+    if (have < sizeof(rec))
+      return -1;
+    memcpy(&rec, c->buf, sizeof(rec));
+    need = sizeof(rec) + rec.key_len + rec.value_len + 2;
+    if (have < need)
+      return -1;
+  }
+  c->key = c->buf + c->off + sizeof(rec);
+  c->value = c->key + rec.key_len + 1;
+  c->off += need;
+  return 1;
+}
+
+static void heap_sift_down(struct run_cursor **heap, size_t n, size_t i) {
+  for (;;) {
+    size_t min = i, l = 2 * i + 1, r = l + 1;
+    if (l < n && strcmp(heap[l]->key, heap[min]->key) < 0)
+      min = l;
+    if (r < n && strcmp(heap[r]->key, heap[min]->key) < 0)
+      min = r;
+    if (min == i)
+      return;
+    struct run_cursor *t = heap[i];
+    heap[i] = heap[min];
+    heap[min] = t;
+    i = min;
   }
-  strncpy(intermediate_buffer[intermediate_count].key, key, MAX_KEY_SIZE);
-  intermediate_buffer[intermediate_count].key[MAX_KEY_SIZE - 1] = '\0';
-  strncpy(intermediate_buffer[intermediate_count].value, value, MAX_VALUE_SIZE);
-  intermediate_buffer[intermediate_count].value[MAX_VALUE_SIZE - 1] = '\0';
-  intermediate_count++;
-  pthread_mutex_unlock(&intermediate_mutex);
+}
+
+// Moves the heap's top cursor to its next record, dropping the cursor once
+// its run is done.
+static int heap_advance(struct run_cursor **heap, size_t *n) {
+  int more = cursor_next(heap[0]);
+  if (more < 0)
+    return -1;
+  if (!more)
+    heap[0] = heap[--*n];
+  heap_sift_down(heap, *n, 0);
   return 0;
 }
 
-int mr_emit_f(const char *key, const char *value) {
-  pthread_mutex_lock(&final_mutex);
-  if (final_count >= MAX_FINAL_KV) {
-    pthread_mutex_unlock(&final_mutex);
+// Gives a cursor on a spilled run a read buffer of at most cap bytes, less
+// for a shorter run, and puts the cursor on the heap if its run has records.
+static int cursor_start(struct run_cursor *c, size_t cap,
+                        struct run_cursor **heap, size_t *n) {
+  if (c->pairs == NULL) {
+    if (c->end - c->next < (off_t)cap)
+      cap = c->end - c->next;
+    c->cap = cap;
+    c->buf = malloc(cap ? cap : 1);
+    if (c->buf == NULL)
+      return -1;
+  }
+  int more = cursor_next(c);
+  if (more > 0)
+    heap[(*n)++] = c;
+  return more < 0 ? -1 : 0;
+}
+
+// Merges count spilled runs into one appended to w's file and leaves a
+// cursor on it in merged.
+static int merge_pass(struct run_cursor *runs, size_t count, size_t cap,
+                      struct run_writer *w, struct run_cursor *merged) {
+  struct run_cursor **heap = malloc(count * sizeof(*heap));
+  size_t n = 0;
+  int ret = heap != NULL ? 0 : -1;
+  for (size_t i = 0; i < count && ret == 0; ++i)
+    ret = cursor_start(&runs[i], cap, heap, &n);
+  for (size_t i = n / 2; ret == 0 && i-- > 0;)
+    heap_sift_down(heap, n, i);
+  off_t start = writer_offset(w);
+  while (ret == 0 && n > 0) {
+    ret = writer_put(w, heap[0]->key, heap[0]->value);
+    if (ret == 0)
+      ret = heap_advance(heap, &n);
+  }
+  if (ret == 0)
+    ret = writer_flush(w);
+  *merged = (struct run_cursor){.fd = w->fd, .next = start,
+                                .end = writer_offset(w)};
+  for (size_t i = 0; i < count; ++i) {
+    free(runs[i].buf);
+    runs[i].buf = NULL;
+  }
+  free(heap);
+  return ret;
+}
+
+// Share of a merge budget for each of ways buffers, within what a run needs.
+static size_t merge_share(size_t budget, size_t ways) {
+  size_t cap = budget / (ways ? ways : 1);
+  if (cap > RUN_BUFFER_SIZE)
+    cap = RUN_BUFFER_SIZE;
+  return cap < RUN_RECORD_MAX ? RUN_RECORD_MAX : cap;
+}
+
+// Streams one partition to fn by merging its spilled runs from every worker
+// with the runs still in memory; only one group's values are held at a time.
+// With a budget, the read buffers of all the spilled runs have to fit in it:
+// while there are more runs than that allows, the oldest are merged into one
+// in a file of the merge's own first, each buffer a record at the least.
+static int merge_runs(const struct reduce_job *job, size_t part,
+                      const struct run_cursor *mem, size_t mem_count) {
+  struct worker_stats *st = reduce_stats();
+  double start = st != NULL ? now_sec() : 0, fn_sec = 0;
+  size_t spilled = 0;
+  for (size_t m = 0; m < job->map_count; ++m) {
+    for (size_t r = 0; r < job->maps[m].run_count; ++r)
+      spilled += job->maps[m].runs[r].part == part;
+  }
+  // Each pass adds a run for the fan_in - 1 it merges, so twice as many
+  // slots as spilled runs always suffice.
+  size_t n_runs = mem_count + 2 * spilled;
+  struct run_cursor *cursors = calloc(n_runs ? n_runs : 1, sizeof(*cursors));
+  struct run_cursor **heap = calloc(n_runs ? n_runs : 1, sizeof(*heap));
+  struct value_scratch scratch = {0};
+  struct run_writer w = {-1, 0, NULL, 0, 0};
+  int ret = -1;
+  if (cursors == NULL || heap == NULL)
+    goto out;
+
+  for (size_t c = 0; c < mem_count; ++c)
+    cursors[c] = mem[c];
+  size_t first = mem_count, last = mem_count;
+  for (size_t m = 0; m < job->map_count; ++m) {
+    for (size_t r = 0; r < job->maps[m].run_count; ++r) {
+      const struct spill_run *run = &job->maps[m].runs[r];
+      if (run->part == part)
+        cursors[last++] = (struct run_cursor){.fd = job->maps[m].spill_fd,
+                                              .next = run->start,
+                                              .end = run->end};
+    }
+  }
+
+  // A pass reads fan_in - 1 runs and writes one, never fewer than two.
+  size_t fan_in = job->budget / RUN_RECORD_MAX;
+  if (fan_in < 3)
+    fan_in = 3;
+  while (job->budget != 0 && last - first > fan_in) {
+    if (w.fd < 0) {
+      char path[PATH_MAX];
+      snprintf(path, sizeof(path), "%s/mr-merge-XXXXXX", job->spill_dir);
+      w.fd = mkstemp(path);
+      if (w.fd < 0)
+        goto out;
+      unlink(path);
+      w.cap = merge_share(job->budget, fan_in);
+      w.buf = malloc(w.cap);
+      if (w.buf == NULL)
+        goto out;
+    }
+    if (merge_pass(&cursors[first], fan_in - 1, w.cap, &w, &cursors[last]) !=
+        0)
+      goto out;
+    first += fan_in - 1;
+    last++;
+  }
+  free(w.buf);
+  w.buf = NULL;
+
+  // The runs in memory go in front of what is left of the spilled ones.
+  first -= mem_count;
+  memmove(&cursors[first], cursors, mem_count * sizeof(*cursors));
+  size_t cap = job->budget != 0
+                   ? merge_share(job->budget, last - first - mem_count)
+                   : RUN_BUFFER_SIZE;
+  size_t n = 0;
+  for (size_t i = first; i < last; ++i) {
+    if (cursor_start(&cursors[i], cap, heap, &n) != 0)
+      goto out;
+  }
+  for (size_t i = n / 2; i-- > 0;)
+    heap_sift_down(heap, n, i);
+
+  while (n > 0) {
+    struct mr_out_kv outkv;
+    strcpy(outkv.key, heap[0]->key);
+    outkv.count = 0;
+    while (n > 0 && strcmp(heap[0]->key, outkv.key) == 0) {
+      if (scratch_reserve(&scratch, outkv.count + 1) != 0)
+        goto out;
+      strcpy(scratch.values[outkv.count++], heap[0]->value);
+      // A failed read leaves the cursor's buffer half refilled, so neither
+      // the partial group nor the heap can be looked at again.
+      if (heap_advance(heap, &n) != 0)
+        goto out;
+    }
+    outkv.value = scratch.values;
+    call_reduce(job->reduce, &outkv, st, &fn_sec);
+  }
+  ret = 0;
+  if (st != NULL) {
+    st->group += now_sec() - start - fn_sec;
+    st->reduce += fn_sec;
+  }
+
+out:
+  free(scratch.values);
+  if (cursors != NULL) {
+    for (size_t i = 0; i < n_runs; ++i)
+      free(cursors[i].buf);
+  }
+  free(cursors);
+  free(heap);
+  free(w.buf);
+  if (w.fd >= 0)
+    close(w.fd);
+  return ret;
+}
+
+// Sorts what a map task left in a partition and publishes it as a run. Once
+// a partition holds PIPELINE_FAN_IN runs of one level, the task that
+// published the last of them merges those into a run of the next level, so
+// merging keeps pace with the mappers instead of waiting for the slowest of
+// them, and each pair is merged only once per level. Merging is only an
+// optimization and is skipped when memory for it is short.
+static int publish_run(struct pipe_part *pp, struct kv_buffer *buf,
+                       enum mr_sort sort) {
+  struct sort_tuple *tuples = sorted_tuples(buf->pairs, buf->count, sort);
+  struct kv_pair *pairs = malloc(buf->count * sizeof(*pairs));
+  if (tuples == NULL || pairs == NULL) {
+    free(tuples);
+    free(pairs);
     return -1;
   }
-  strncpy(final_buffer[final_count].key, key, MAX_KEY_SIZE);
-  final_buffer[final_count].key[MAX_KEY_SIZE - 1] = '\0';
-  strncpy(final_buffer[final_count].value, value, MAX_VALUE_SIZE);
-  final_buffer[final_count].value[MAX_VALUE_SIZE - 1] = '\0';
-  final_count++;
-  pthread_mutex_unlock(&final_mutex);
+  for (size_t i = 0; i < buf->count; ++i)
+    pairs[i] = buf->pairs[tuples[i].idx];
+  free(tuples);
+  struct pipe_run run = {pairs, buf->count, buf->arena, 0};
+  buf->arena = (struct arena){NULL};
+  buf->count = 0;
+  buf->bytes = 0;
+
+  for (;;) {
+    pthread_mutex_lock(&pp->lock);
+    if (pp->count == pp->cap) {
+      size_t cap = pp->cap ? pp->cap * 2 : PIPELINE_FAN_IN;
+      struct pipe_run *runs = realloc(pp->runs, cap * sizeof(*runs));
+      if (runs == NULL) {
+        pthread_mutex_unlock(&pp->lock);
+        free(run.pairs);
+        arena_free(&run.arena);
+        return -1;
+      }
+      pp->runs = runs;
+      pp->cap = cap;
+    }
+    pp->runs[pp->count++] = run;
+    size_t n = 0, total = 0;
+    for (size_t r = 0; r < pp->count; ++r) {
+      if (pp->runs[r].level == run.level) {
+        n++;
+        total += pp->runs[r].count;
+      }
+    }
+    struct pipe_run *batch = NULL;
+    struct kv_pair *merged = NULL;
+    struct run_cursor *cursors = NULL;
+    struct run_cursor **heap = NULL;
+    if (n >= PIPELINE_FAN_IN) {
+      batch = malloc(n * sizeof(*batch));
+      merged = malloc(total * sizeof(*merged));
+      cursors = malloc(n * sizeof(*cursors));
+      heap = malloc(n * sizeof(*heap));
+    }
+    if (batch == NULL || merged == NULL || cursors == NULL || heap == NULL) {
+      pthread_mutex_unlock(&pp->lock);
+      free(batch);
+      free(merged);
+      free(cursors);
+      free(heap);
+      return 0;
+    }
+    size_t kept = 0;
+    n = 0;
+    for (size_t r = 0; r < pp->count; ++r) {
+      if (pp->runs[r].level == run.level)
+        batch[n++] = pp->runs[r];
+      else
+        pp->runs[kept++] = pp->runs[r];
+    }
+    pp->count = kept;
+    pthread_mutex_unlock(&pp->lock);
+
+    size_t h = 0;
+    for (size_t r = 0; r < n; ++r) {
+      cursors[r] = (struct run_cursor){.pairs = batch[r].pairs,
+                                       .count = batch[r].count};
+      if (cursor_next(&cursors[r]) > 0)
+        heap[h++] = &cursors[r];
+    }
+    for (size_t i = h / 2; i-- > 0;)
+      heap_sift_down(heap, h, i);
+    // Cursors over memory cannot fail.
+    for (size_t k = 0; h > 0; ++k) {
+      merged[k] = (struct kv_pair){heap[0]->key, heap[0]->value};
+      heap_advance(heap, &h);
+    }
+    run = (struct pipe_run){merged, total, {NULL}, run.level + 1};
+    for (size_t r = 0; r < n; ++r) {
+      free(batch[r].pairs);
+      arena_splice(&run.arena, &batch[r].arena);
+    }
+    free(batch);
+    free(cursors);
+    free(heap);
+  }
+}
+
+// Replaces a partition with the combiner's output for it. Every key the
+// combiner emits hashes back to the same partition.
+static int combine_partition(struct map_output *out, size_t part) {
+  struct kv_buffer old = out->parts[part];
+  out->parts[part] = (struct kv_buffer){0};
+  combining = 1;
+  int ret = reduce_pairs(old.pairs, old.count, out->combine, out->sort);
+  combining = 0;
+  kv_buffer_free(&old);
+  if (ret != 0)
+    out->failed = 1;
+
+  struct kv_buffer *buf = &out->parts[part];
+  buf->combine_at = buf->count * 2;
+  if (buf->combine_at < COMBINE_BATCH)
+    buf->combine_at = COMBINE_BATCH;
+  return ret;
+}
+
+static int array_source_read(void *ctx, size_t split,
+                             void (*map)(const struct mr_in_kv *)) {
+  struct array_source *src = ctx;
+  size_t start = split * src->chunk;
+  size_t end = start + src->chunk;
+  if (end > src->count)
+    end = src->count;
+  for (size_t i = start; i < end; ++i) {
+    map(&(src->kv_lst[i]));
+  }
+  return 0;
+}
+
+// A record belongs to the split it starts in, so a split skips the end of a
+// record begun before it and finishes the one running past its end; splits
+// line up with records without a pass over the file up front. Each record
+// is handed to map keyed by its byte offset, in pieces if it is too long for
+// one mr_in_kv.
+static int file_source_read(void *ctx, size_t split,
+                            void (*map)(const struct mr_in_kv *)) {
+  struct file_source *src = ctx;
+  size_t start = split * src->split_size;
+  size_t end = start + src->split_size;
+  if (end > src->size)
+    end = src->size;
+  if (start > 0 && start < end) {
+    const char *p = memchr(src->data + start - 1, src->delim,
+                           src->size - start + 1);
+    start = p != NULL ? (size_t)(p - src->data) + 1 : src->size;
+  }
+
+  struct mr_in_kv kv;
+  while (start < end) {
+    const char *p = memchr(src->data + start, src->delim, src->size - start);
+    size_t len = (p != NULL ? (size_t)(p - src->data) : src->size) - start;
+    for (size_t off = 0; off == 0 || off < len; off += MAX_VALUE_SIZE - 1) {
+      size_t copy = len - off;
+      if (copy > MAX_VALUE_SIZE - 1)
+        copy = MAX_VALUE_SIZE - 1;
+      snprintf(kv.key, MAX_KEY_SIZE, "%zu", start + off);
+      memcpy(kv.value, src->data + start + off, copy);
+      kv.value[copy] = '\0';
+      map(&kv);
+    }
+    start += len + 1;
+  }
+  return 0;
+}
+
+// Stands in for map when collecting stats, to count the input records.
+static void counted_map(const struct mr_in_kv *kv) {
+  current_stats->records++;
+  current_map_fn(kv);
+}
+
+static void map_task(void *arg, size_t task) {
+  struct map_job *job = arg;
+  struct map_output *out = &job->outputs[workpool_worker()];
+  current_stats = job->stats ? &job->stats[workpool_worker()] : NULL;
+  double start = current_stats != NULL ? now_sec() : 0;
+  current_map = out;
+  current_map_fn = job->map;
+  if (job->source->read(job->source->ctx, task,
+                        current_stats != NULL ? counted_map : job->map) != 0)
+    out->failed = 1;
+  // Pipelined, each task hands its output on as sorted runs right away.
+  for (size_t p = 0; job->pipe != NULL && p < out->part_count; ++p) {
+    struct kv_buffer *buf = &out->parts[p];
+    if (out->combine != NULL && buf->count > 0)
+      combine_partition(out, p);
+    if (buf->count > 0 && publish_run(&job->pipe[p], buf, out->sort) != 0)
+      out->failed = 1;
+  }
+  current_map = NULL;
+  if (current_stats != NULL)
+    current_stats->busy += now_sec() - start;
+  current_stats = NULL;
+}
+
+// Runs once the whole map phase is done, one task per worker and partition.
+static void combine_task(void *arg, size_t task) {
+  struct map_job *job = arg;
+  struct map_output *out = &job->outputs[task / job->outputs->part_count];
+  struct worker_stats *st = job->stats ? &job->stats[workpool_worker()] : NULL;
+  double start = st != NULL ? now_sec() : 0;
+  current_map = out;
+  combine_partition(out, task % out->part_count);
+  current_map = NULL;
+  if (st != NULL)
+    st->busy += now_sec() - start;
+}
+
+// Merges the runs the map tasks published for one partition.
+static int reduce_published(const struct reduce_job *job, size_t part) {
+  struct pipe_part *pp = &job->pipe[part];
+  struct run_cursor *mem = calloc(pp->count ? pp->count : 1, sizeof(*mem));
+  if (mem == NULL)
+    return -1;
+  for (size_t r = 0; r < pp->count; ++r)
+    mem[r] = (struct run_cursor){.pairs = pp->runs[r].pairs,
+                                 .count = pp->runs[r].count};
+  int ret = merge_runs(job, part, mem, pp->count);
+  free(mem);
+  return ret;
+}
+
+// Collects one partition from every worker's map output, then sorts and
+// groups it; partitions are reduced concurrently instead of one global sort.
+// In spill mode the partition is merged with its runs on disk instead.
+static int reduce_collected(const struct reduce_job *job, size_t part) {
+  size_t count = 0;
+  for (size_t m = 0; m < job->map_count; ++m)
+    count += job->maps[m].parts[part].count;
+  struct kv_pair *pairs = malloc((count ? count : 1) * sizeof(*pairs));
+  if (pairs == NULL)
+    return -1;
+  count = 0;
+  for (size_t m = 0; m < job->map_count; ++m) {
+    struct kv_buffer *buf = &job->maps[m].parts[part];
+    if (buf->count == 0)
+      continue;
+    memcpy(pairs + count, buf->pairs, buf->count * sizeof(*pairs));
+    count += buf->count;
+  }
+  int spilled = 0;
+  for (size_t m = 0; m < job->map_count; ++m)
+    spilled = spilled || job->maps[m].run_count > 0;
+
+  int ret;
+  if (spilled) {
+    struct worker_stats *st = reduce_stats();
+    double start = st != NULL ? now_sec() : 0;
+    struct sort_tuple *tuples = sorted_tuples(pairs, count, job->sort);
+    if (st != NULL)
+      st->sort += now_sec() - start;
+    struct run_cursor mem = {.pairs = pairs, .tuples = tuples, .count = count};
+    ret = tuples != NULL ? merge_runs(job, part, &mem, 1) : -1;
+    free(tuples);
+  } else {
+    ret = reduce_pairs(pairs, count, job->reduce, job->sort);
+  }
+  free(pairs);
+  return ret;
+}
+
+static void reduce_task(void *arg, size_t part) {
+  struct reduce_job *job = arg;
+  current_stats = job->stats ? &job->stats[workpool_worker()] : NULL;
+  double start = current_stats != NULL ? now_sec() : 0;
+  final_buffer = &job->outs[part];
+  int ret = job->pipe != NULL ? reduce_published(job, part)
+                              : reduce_collected(job, part);
+  // Partitions are reduced concurrently, so the flag is only ever set.
+  if (ret != 0)
+    __atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+  final_buffer = NULL;
+  if (current_stats != NULL)
+    current_stats->busy += now_sec() - start;
+  current_stats = NULL;
+}
+
+// Keys and values are truncated to what fits the fixed-size mr_out_kv slots
+// they are eventually handed out in. Emits from a thread that is not running
+// a map or reduce task have no buffer to land in and fail.
+static int kv_buffer_append(struct kv_buffer *buf, const char *key,
+                            const char *value) {
+  if (buf == NULL)
+    return -1;
+  if (buf->count == buf->cap) {
+    size_t cap = buf->cap ? buf->cap * 2 : 256;
+    struct kv_pair *pairs = realloc(buf->pairs, cap * sizeof(*pairs));
+    if (pairs == NULL)
+      return -1;
+    buf->pairs = pairs;
+    buf->cap = cap;
+  }
+  size_t key_len = strnlen(key, MAX_KEY_SIZE - 1);
+  size_t value_len = strnlen(value, MAX_VALUE_SIZE - 1);
+  char *p = arena_alloc(&buf->arena, key_len + value_len + 2);
+  if (p == NULL)
+    return -1;
+  memcpy(p, key, key_len);
+  p[key_len] = '\0';
+  memcpy(p + key_len + 1, value, value_len);
+  p[key_len + 1 + value_len] = '\0';
+  buf->pairs[buf->count].key = p;
+  buf->pairs[buf->count].value = p + key_len + 1;
+  buf->count++;
+  buf->bytes += sizeof(struct kv_pair) + key_len + value_len + 2;
   return 0;
 }
 
-int compare_kv(const void *a, const void *b) {
-  const char *ka = ((const char *)a);
-  const char *kb = ((const char *)b);
-  return strncmp(ka, kb, MAX_KEY_SIZE);
+int mr_emit_i(const char *key, const char *value) {
+  struct map_output *out = current_map;
+  if (out == NULL)
+    return -1;
+  size_t part = key_hash(key) % out->part_count;
+  struct kv_buffer *buf = &out->parts[part];
+  size_t before = buf->bytes;
+  // With a combiner, a growing partition is folded down in place, so a
+  // word-count style mapper holds one pair per distinct key at a time.
+  if (out->combine != NULL && !combining && buf->count >= buf->combine_at &&
+      combine_partition(out, part) != 0)
+    return -1;
+  if (kv_buffer_append(buf, key, value) != 0)
+    return -1;
+  // The combiner's own emits are accounted by the emit that triggered it.
+  if (combining)
+    return 0;
+  if (current_stats != NULL) {
+    current_stats->pairs++;
+    current_stats->bytes += strnlen(key, MAX_KEY_SIZE - 1) +
+                            strnlen(value, MAX_VALUE_SIZE - 1);
+  }
+  out->bytes = out->bytes - before + buf->bytes;
+  if (out->budget != 0 && out->bytes > out->budget &&
+      spill_output(out) != 0) {
+    out->failed = 1;
+    return -1;
+  }
+  return 0;
 }
+
+int mr_emit_f(const char *key, const char *value) {
+  return kv_buffer_append(final_buffer, key, value);
+}
+
 int outcompare(const void *a, const void *b) {
   const struct mr_out_kv *kvA = a;
   const struct mr_out_kv *kvB = b;
   return strcmp(kvA->key, kvB->key);
 }
-int mr_exec(const struct mr_input *input, void (*map)(const struct mr_in_kv *),
-            size_t mapper_count, void (*reduce)(const struct mr_out_kv *),
-            size_t reducer_count, struct mr_output *output) {
 
-  intermediate_count = 0;
-  final_count = 0;
+// Hands every reducer's final pairs out as the job's output, sorted by key.
+static void collect_output(const struct kv_buffer *outs, size_t reducer_count,
+                           struct mr_output *output, size_t threads) {
+  size_t final_count = 0;
+  for (size_t i = 0; i < reducer_count; ++i)
+    final_count += outs[i].count;
+  output->count = final_count;
+  output->kv_lst = calloc(final_count, sizeof(struct mr_out_kv));
+  size_t out_idx = 0;
+  for (size_t i = 0; i < reducer_count; ++i) {
+    for (size_t k = 0; k < outs[i].count; ++k) {
+      struct mr_out_kv *kv = &output->kv_lst[out_idx++];
+      strcpy(kv->key, outs[i].pairs[k].key);
+      kv->count = 1;
+      kv->value = malloc(MAX_VALUE_SIZE);
+      strcpy(kv->value[0], outs[i].pairs[k].value);
+    }
+  }
+
+  psort(output->kv_lst, output->count, sizeof(struct mr_out_kv), outcompare,
+        threads);
+}
+
+// Multi-process mode. The coordinator forks worker processes and deals them
+// map and reduce tasks over a socketpair each; the processes share data
+// through files in a job directory instead of memory. A map task writes its
+// output to map-<task> as sorted runs followed by the run table, and a
+// reduce task merges its partition's runs from every map file into
+// reduce-<part>. Files are written under a .tmp name and renamed once
+// complete, so a task retried after its worker died starts from scratch.
 
-  size_t total_input = input->count;
-  size_t base_chunk = total_input / mapper_count;
-  size_t remainder = total_input % mapper_count;
+enum task_kind { TASK_MAP, TASK_REDUCE };
+enum task_state { TASK_WAITING, TASK_RUNNING, TASK_DONE };
 
-  size_t map_task_starts[mapper_count];
-  size_t map_task_ends[mapper_count];
+struct task_msg {
+  uint32_t kind;
+  uint64_t idx;
+};
 
-  size_t idx = 0;
-  for (size_t i = 0; i < mapper_count; i++) {
-    map_task_starts[i] = idx;
-    size_t chunk_size = base_chunk + (i < remainder ? 1 : 0);
-    map_task_ends[i] = idx + chunk_size;
-    idx += chunk_size;
-  }
-
-  pthread_t mapper_threads[mapper_count];
-  struct map_task_arg map_args[mapper_count];
-
-  for (size_t i = 0; i < mapper_count; ++i) {
-    map_args[i].kv_lst = input->kv_lst;
-    map_args[i].start_idx = map_task_starts[i];
-    map_args[i].end_idx = map_task_ends[i];
-    map_args[i].map = map;
-    if (pthread_create(&mapper_threads[i], NULL, map_thread, &map_args[i]) !=
-        0) {
+struct proc_job {
+  const struct mr_source *source;
+  void (*map)(const struct mr_in_kv *);
+  void (*combine)(const struct mr_out_kv *);
+  void (*reduce)(const struct mr_out_kv *);
+  size_t map_tasks;
+  size_t part_count;
+  enum mr_sort sort;
+  size_t budget; // per process
+  double timeout; // seconds per task
+  char dir[PATH_MAX - 64]; // leaves room for the task file names
+};
+
+struct proc_worker {
+  pid_t pid;
+  int sock; // -1 once the worker is gone
+  int busy;
+  size_t task;
+  double started; // when the task was sent
+};
+
+static void task_path(char *path, const struct proc_job *job,
+                      const char *kind, size_t idx, int tmp) {
+  snprintf(path, PATH_MAX, "%s/%s-%zu%s", job->dir, kind, idx,
+           tmp ? ".tmp" : "");
+}
+
+// Like read, but for exactly len bytes; a short read is an error.
+static int read_full(int fd, void *buf, size_t len) {
+  char *p = buf;
+  while (len > 0) {
+    ssize_t n = read(fd, p, len);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return -1;
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
+
+static int pread_full(int fd, void *buf, size_t len, off_t off) {
+  char *p = buf;
+  while (len > 0) {
+    ssize_t n = pread(fd, p, len, off);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
       return -1;
+    p += n;
+    len -= n;
+    off += n;
+  }
+  return 0;
+}
+
+// Runs the map over one split, then spills everything it buffered into the
+// task's map file. In spill mode the earlier spills went to the same file,
+// so the file is exactly the runs the table lists.
+static int proc_map(const struct proc_job *job, size_t task) {
+  char tmp[PATH_MAX], path[PATH_MAX];
+  task_path(tmp, job, "map", task, 1);
+  task_path(path, job, "map", task, 0);
+  struct map_output out = {0};
+  out.combine = job->combine;
+  out.part_count = job->part_count;
+  out.sort = job->sort;
+  out.budget = job->budget;
+  out.spill_dir = job->dir;
+  out.parts = calloc(job->part_count, sizeof(*out.parts));
+  out.spill_fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  int ret = -1;
+  if (out.parts == NULL || out.spill_fd < 0)
+    goto out;
+  for (size_t p = 0; p < out.part_count; ++p)
+    out.parts[p].combine_at = COMBINE_BATCH;
+
+  current_map = &out;
+  int read = job->source->read(job->source->ctx, task, job->map);
+  for (size_t p = 0; out.combine != NULL && p < out.part_count; ++p)
+    combine_partition(&out, p);
+  current_map = NULL;
+  if (read != 0 || out.failed || spill_output(&out) != 0)
+    goto out;
+  uint64_t run_count = out.run_count;
+  if (write_all(out.spill_fd, (const char *)out.runs,
+                out.run_count * sizeof(*out.runs)) == 0 &&
+      write_all(out.spill_fd, (const char *)&run_count,
+                sizeof(run_count)) == 0 &&
+      rename(tmp, path) == 0)
+    ret = 0;
+
+out:
+  for (size_t p = 0; out.parts != NULL && p < out.part_count; ++p)
+    kv_buffer_free(&out.parts[p]);
+  free(out.parts);
+  free(out.runs);
+  if (out.spill_fd >= 0)
+    close(out.spill_fd);
+  return ret;
+}
+
+// Opens a finished map file and reads its run table into out, keeping the
+// file open only if it has a run for part.
+static int open_map_file(const struct proc_job *job, size_t task, size_t part,
+                         struct map_output *out) {
+  char path[PATH_MAX];
+  task_path(path, job, "map", task, 0);
+  int fd = open(path, O_RDONLY);
+  struct stat st;
+  uint64_t run_count;
+  if (fd < 0 || fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(run_count) ||
+      pread_full(fd, &run_count, sizeof(run_count),
+                 st.st_size - sizeof(run_count)) != 0 ||
+      run_count > (st.st_size - sizeof(run_count)) / sizeof(*out->runs))
+    goto fail;
+  size_t table = run_count * sizeof(*out->runs);
+  out->runs = malloc(table ? table : 1);
+  if (out->runs == NULL ||
+      pread_full(fd, out->runs, table,
+                 st.st_size - sizeof(run_count) - table) != 0)
+    goto fail;
+  out->run_count = run_count;
+  for (size_t r = 0; r < out->run_count; ++r) {
+    if (out->runs[r].part == part) {
+      out->spill_fd = fd;
+      return 0;
     }
   }
+  out->run_count = 0;
+  close(fd);
+  return 0;
+
+fail:
+  if (fd >= 0)
+    close(fd);
+  return -1;
+}
 
-  for (size_t i = 0; i < mapper_count; ++i) {
-    pthread_join(mapper_threads[i], NULL);
+// Merges one partition's runs from every map file through reduce and
+// writes the final pairs to the partition's reduce file.
+static int proc_reduce(const struct proc_job *job, size_t part) {
+  char tmp[PATH_MAX], path[PATH_MAX];
+  task_path(tmp, job, "reduce", part, 1);
+  task_path(path, job, "reduce", part, 0);
+  struct map_output *maps = calloc(job->map_tasks ? job->map_tasks : 1,
+                                   sizeof(*maps));
+  struct kv_buffer out = {0};
+  struct run_writer w = {-1, 0, malloc(SPILL_BUFFER_SIZE), 0,
+                         SPILL_BUFFER_SIZE};
+  int ret = -1;
+  for (size_t m = 0; maps != NULL && m < job->map_tasks; ++m)
+    maps[m].spill_fd = -1;
+  if (maps == NULL || w.buf == NULL)
+    goto out;
+  for (size_t m = 0; m < job->map_tasks; ++m) {
+    if (open_map_file(job, m, part, &maps[m]) != 0)
+      goto out;
   }
 
-  qsort(intermediate_buffer, intermediate_count, sizeof(intermediate_buffer[0]),
-        compare_kv);
+  struct reduce_job reduce_job = {maps, job->map_tasks, job->reduce, NULL,
+                                  job->sort, 0, NULL, NULL, job->budget,
+                                  job->dir};
+  final_buffer = &out;
+  int merged = merge_runs(&reduce_job, part, NULL, 0);
+  final_buffer = NULL;
+  w.fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  if (merged != 0 || w.fd < 0)
+    goto out;
+  for (size_t i = 0; i < out.count; ++i) {
+    if (writer_put(&w, out.pairs[i].key, out.pairs[i].value) != 0)
+      goto out;
+  }
+  if (writer_flush(&w) == 0 && rename(tmp, path) == 0)
+    ret = 0;
 
-  key_group *groups = malloc(intermediate_count * sizeof(key_group));
-  size_t group_count = 0;
+out:
+  for (size_t m = 0; maps != NULL && m < job->map_tasks; ++m) {
+    if (maps[m].spill_fd >= 0)
+      close(maps[m].spill_fd);
+    free(maps[m].runs);
+  }
+  free(maps);
+  kv_buffer_free(&out);
+  if (w.fd >= 0)
+    close(w.fd);
+  free(w.buf);
+  return ret;
+}
 
-  idx = 0;
-  while (idx < intermediate_count) {
-    size_t j = idx + 1;
-    while (j < intermediate_count &&
-           strncmp(intermediate_buffer[idx].key, intermediate_buffer[j].key,
-                   MAX_KEY_SIZE) == 0) {
-      j++;
+// Body of a worker process: runs the tasks it is sent and answers each
+// with its status, until the coordinator hangs up.
+static void worker_main(int sock, const struct proc_job *job) {
+  struct task_msg msg;
+  while (read_full(sock, &msg, sizeof(msg)) == 0) {
+    int32_t status = msg.kind == TASK_MAP ? proc_map(job, msg.idx)
+                                          : proc_reduce(job, msg.idx);
+    if (write_all(sock, (const char *)&status, sizeof(status)) != 0)
+      break;
+  }
+  fflush(NULL);
+  _exit(0);
+}
+
+static int spawn_worker(struct proc_worker *workers, size_t n, size_t i,
+                        const struct proc_job *job) {
+  int sv[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0)
+    return -1;
+  fflush(NULL);
+  pid_t pid = fork();
+  if (pid < 0) {
+    close(sv[0]);
+    close(sv[1]);
+    return -1;
+  }
+  if (pid == 0) {
+    // Hold no other worker's socket, so each sees its own coordinator
+    // hang up as soon as it does.
+    close(sv[0]);
+    for (size_t k = 0; k < n; ++k) {
+      if (workers[k].sock >= 0)
+        close(workers[k].sock);
+    }
+    worker_main(sv[1], job);
+  }
+  close(sv[1]);
+  workers[i] = (struct proc_worker){pid, sv[0], 0, 0, 0};
+  return 0;
+}
+
+static void reap_worker(struct proc_worker *w) {
+  close(w->sock);
+  w->sock = -1;
+  waitpid(w->pid, NULL, 0);
+}
+
+// Runs tasks 0..count-1 of one kind on the workers. A task whose worker
+// dies, which fails, or which is still running after job->timeout seconds
+// goes back in the queue until it has used up its attempts; a dead or hung
+// worker is replaced by a fresh process.
+static int run_phase(struct proc_worker *workers, size_t n,
+                     const struct proc_job *job, uint32_t kind,
+                     size_t count) {
+  unsigned char *state = calloc(count ? count : 1, 1);
+  unsigned char *attempts = calloc(count ? count : 1, 1);
+  struct pollfd *fds = calloc(n, sizeof(*fds));
+  int ret = -1;
+  if (state == NULL || attempts == NULL || fds == NULL)
+    goto out;
+
+  size_t done = 0, next = 0;
+  int failed = 0;
+  while (!failed && done < count) {
+    for (size_t i = 0; i < n && !failed; ++i) {
+      while (next < count && state[next] != TASK_WAITING)
+        next++;
+      if (workers[i].busy || next == count)
+        continue;
+      struct task_msg msg = {kind, next};
+      if (send(workers[i].sock, &msg, sizeof(msg), MSG_NOSIGNAL) !=
+          (ssize_t)sizeof(msg)) {
+        reap_worker(&workers[i]);
+        failed = spawn_worker(workers, n, i, job) != 0;
+        continue;
+      }
+      state[next] = TASK_RUNNING;
+      attempts[next]++;
+      workers[i].busy = 1;
+      workers[i].task = next;
+      workers[i].started = now_sec();
     }
 
-    groups[group_count].value_count = j - idx;
-    strncpy(groups[group_count].key, intermediate_buffer[idx].key,
-            MAX_KEY_SIZE);
-    groups[group_count].key[MAX_KEY_SIZE - 1] = '\0';
-    groups[group_count].values =
-        malloc(groups[group_count].value_count * sizeof(char *));
-    for (size_t k = 0; k < groups[group_count].value_count; ++k) {
-      groups[group_count].values[k] = malloc(MAX_VALUE_SIZE);
-      strncpy(groups[group_count].values[k], intermediate_buffer[idx + k].value,
-              MAX_VALUE_SIZE);
-      groups[group_count].values[k][MAX_VALUE_SIZE - 1] = '\0';
-      /*size_t len = strlen(intermediate_buffer[idx + k].value) + 1;
-      groups[group_count].values[k] = malloc(len);
-      strncpy(groups[group_count].values[k], intermediate_buffer[idx + k].value,
-              len);
-      */
-    }
-    group_count++;
-    idx = j;
+    // Wake up for the first task to run out of time, if nothing else.
+    int wait_ms = -1;
+    double now = now_sec();
+    for (size_t i = 0; i < n; ++i) {
+      fds[i] = (struct pollfd){workers[i].sock, POLLIN, 0};
+      double left = workers[i].started + job->timeout - now;
+      int ms = left <= 0               ? 0
+               : left < INT_MAX / 1000 ? (int)(left * 1000) + 1
+                                       : INT_MAX;
+      if (workers[i].busy && (wait_ms < 0 || ms < wait_ms))
+        wait_ms = ms;
+    }
+    if (failed || poll(fds, n, wait_ms) < 0) {
+      failed = failed || errno != EINTR;
+      continue;
+    }
+    now = now_sec();
+    for (size_t i = 0; i < n && !failed; ++i) {
+      int hung = workers[i].busy && fds[i].revents == 0 &&
+                 now >= workers[i].started + job->timeout;
+      if (fds[i].revents == 0 && !hung)
+        continue;
+      int busy = workers[i].busy;
+      size_t task = workers[i].task;
+      int32_t status = -1;
+      workers[i].busy = 0;
+      if (hung) {
+        kill(workers[i].pid, SIGKILL);
+        reap_worker(&workers[i]);
+        failed = spawn_worker(workers, n, i, job) != 0;
+      } else if (read_full(workers[i].sock, &status, sizeof(status)) != 0) {
+        reap_worker(&workers[i]);
+        failed = spawn_worker(workers, n, i, job) != 0;
+      } else if (!busy) {
+        failed = 1; // an answer nobody asked for
+      }
+      if (busy && !failed) {
+        if (status == 0) {
+          state[task] = TASK_DONE;
+          done++;
+        } else if (attempts[task] < TASK_ATTEMPTS) {
+          state[task] = TASK_WAITING;
+          next = task < next ? task : next;
+        } else {
+          failed = 1;
+        }
+      }
+    }
   }
+  ret = failed ? -1 : 0;
 
-  size_t reduce_base_chunk = group_count / reducer_count;
-  size_t reduce_remainder = group_count % reducer_count;
+out:
+  free(state);
+  free(attempts);
+  free(fds);
+  return ret;
+}
 
-  size_t reduce_starts[reducer_count];
-  size_t reduce_ends[reducer_count];
+// Reads a finished reduce file into the partition's final pairs.
+static int read_reduce_file(const struct proc_job *job, size_t part,
+                            struct kv_buffer *out) {
+  char path[PATH_MAX];
+  task_path(path, job, "reduce", part, 0);
+  int fd = open(path, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    if (fd >= 0)
+      close(fd);
+    return -1;
+  }
+  size_t cap = st.st_size < RUN_BUFFER_SIZE ? st.st_size : RUN_BUFFER_SIZE;
+  struct run_cursor c = {.fd = fd, .end = st.st_size, .cap = cap};
+  c.buf = malloc(cap ? cap : 1);
+  int more = c.buf != NULL ? cursor_next(&c) : -1;
+  while (more > 0) {
+    if (kv_buffer_append(out, c.key, c.value) != 0)
+      more = -1;
+    else
+      more = cursor_next(&c);
+  }
+  free(c.buf);
+  close(fd);
+  return more;
+}
 
-  size_t reduce_idx = 0;
-  for (size_t i = 0; i < reducer_count; ++i) {
-    reduce_starts[i] = reduce_idx;
-    size_t chunk_size = reduce_base_chunk + (i < reduce_remainder ? 1 : 0);
-    reduce_ends[i] = reduce_idx + chunk_size;
-    reduce_idx += chunk_size;
+static void remove_job_files(const struct proc_job *job) {
+  char path[PATH_MAX];
+  for (size_t m = 0; m < job->map_tasks; ++m) {
+    for (int tmp = 0; tmp < 2; ++tmp) {
+      task_path(path, job, "map", m, tmp);
+      unlink(path);
+    }
   }
+  for (size_t p = 0; p < job->part_count; ++p) {
+    for (int tmp = 0; tmp < 2; ++tmp) {
+      task_path(path, job, "reduce", p, tmp);
+      unlink(path);
+    }
+  }
+  rmdir(job->dir);
+}
 
-  pthread_t reducer_threads[reducer_count];
-  struct reduce_task_arg reduce_args[reducer_count];
-  for (size_t i = 0; i < reducer_count; ++i) {
-    reduce_args[i].groups = groups;
-    reduce_args[i].start_idx = reduce_starts[i];
-    reduce_args[i].end_idx = reduce_ends[i];
-    reduce_args[i].reduce = reduce;
-    if (pthread_create(&reducer_threads[i], NULL, reduce_thread,
-                       &reduce_args[i]) != 0)
+static int exec_processes(const struct mr_source *source,
+                          void (*map)(const struct mr_in_kv *),
+                          void (*reduce)(const struct mr_out_kv *),
+                          size_t reducer_count, struct mr_output *output,
+                          const struct mr_options *opts,
+                          const char *spill_dir) {
+  size_t n = opts->processes;
+  struct mr_stats st = {0};
+  double start = now_sec(), mark = start;
+  struct proc_job job = {source, map, opts->combine, reduce, source->splits,
+                         reducer_count, opts->sort,
+                         (opts->memory_budget + n - 1) / n,
+                         opts->task_timeout > 0 ? opts->task_timeout
+                                                : TASK_TIMEOUT,
+                         ""};
+  snprintf(job.dir, sizeof(job.dir), "%s/mr-job-XXXXXX", spill_dir);
+  if (mkdtemp(job.dir) == NULL)
+    return -1;
+
+  struct proc_worker *workers = calloc(n, sizeof(*workers));
+  struct kv_buffer *outs = calloc(reducer_count, sizeof(*outs));
+  int ret = -1;
+  for (size_t i = 0; workers != NULL && i < n; ++i)
+    workers[i].sock = -1;
+  if (workers == NULL || outs == NULL)
+    goto out;
+  for (size_t i = 0; i < n; ++i) {
+    if (spawn_worker(workers, n, i, &job) != 0)
+      goto out;
+  }
+  if (run_phase(workers, n, &job, TASK_MAP, job.map_tasks) != 0)
+    goto out;
+  st.map_sec = lap(&mark);
+  if (run_phase(workers, n, &job, TASK_REDUCE, reducer_count) != 0)
+    goto out;
+  st.reduce_sec = lap(&mark);
+  for (size_t p = 0; p < reducer_count; ++p) {
+    if (read_reduce_file(&job, p, &outs[p]) != 0)
+      goto out;
+  }
+  collect_output(outs, reducer_count, output, n);
+  st.output_sec = lap(&mark);
+  // The work itself happens in the workers, so only the phases are known.
+  st.total_sec = now_sec() - start;
+  st.output_pairs = output->count;
+  st.threads = n;
+  if (opts->stats != NULL)
+    *opts->stats = st;
+  ret = 0;
+
+out:
+  for (size_t i = 0; workers != NULL && i < n; ++i) {
+    if (workers[i].sock >= 0)
+      reap_worker(&workers[i]);
+  }
+  for (size_t p = 0; outs != NULL && p < reducer_count; ++p)
+    kv_buffer_free(&outs[p]);
+  free(workers);
+  free(outs);
+  remove_job_files(&job);
+  return ret;
+}
+
+int mr_source_open(struct mr_source *source, const char *path, char delim,
+                   size_t split_size) {
+  struct file_source *src = calloc(1, sizeof(*src));
+  if (src == NULL)
+    return -1;
+  int fd = open(path, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    if (fd >= 0)
+      close(fd);
+    free(src);
+    return -1;
+  }
+  src->size = st.st_size;
+  src->split_size = split_size ? split_size : SOURCE_SPLIT_SIZE;
+  src->delim = delim;
+  // An empty file cannot be mapped and simply has no splits.
+  if (src->size > 0) {
+    void *data = mmap(NULL, src->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+      close(fd);
+      free(src);
       return -1;
+    }
+    madvise(data, src->size, MADV_SEQUENTIAL);
+    src->data = data;
   }
-  for (size_t i = 0; i < reducer_count; ++i) {
-    pthread_join(reducer_threads[i], NULL);
+  close(fd);
+  source->splits = (src->size + src->split_size - 1) / src->split_size;
+  source->read = file_source_read;
+  source->ctx = src;
+  return 0;
+}
+
+void mr_source_close(struct mr_source *source) {
+  struct file_source *src = source->ctx;
+  if (src->size > 0)
+    munmap((void *)src->data, src->size);
+  free(src);
+}
+
+int mr_exec_ex(const struct mr_input *input,
+               void (*map)(const struct mr_in_kv *), size_t mapper_count,
+               void (*reduce)(const struct mr_out_kv *), size_t reducer_count,
+               struct mr_output *output, const struct mr_options *opts) {
+  size_t threads = mapper_count > reducer_count ? mapper_count : reducer_count;
+  struct array_source array = {input->kv_lst, input->count, 0};
+  array.chunk = input->count / (threads * MAP_TASKS_PER_WORKER);
+  if (array.chunk == 0)
+    array.chunk = 1;
+  struct mr_source source = {(input->count + array.chunk - 1) / array.chunk,
+                             array_source_read, &array};
+  return mr_exec_source(&source, map, mapper_count, reduce, reducer_count,
+                        output, opts);
+}
+
+int mr_exec_source(const struct mr_source *source,
+                   void (*map)(const struct mr_in_kv *), size_t mapper_count,
+                   void (*reduce)(const struct mr_out_kv *),
+                   size_t reducer_count, struct mr_output *output,
+                   const struct mr_options *opts) {
+  void (*combine)(const struct mr_out_kv *) = opts ? opts->combine : NULL;
+  enum mr_sort sort = opts ? opts->sort : MR_SORT_RADIX;
+  size_t budget = opts ? opts->memory_budget : 0;
+  struct mr_stats *stats = opts ? opts->stats : NULL;
+  const char *spill_dir = opts ? opts->spill_dir : NULL;
+  if (spill_dir == NULL)
+    spill_dir = getenv("TMPDIR");
+  if (spill_dir == NULL)
+    spill_dir = "/tmp";
+  if (reducer_count == 0)
+    return -1;
+  if (opts != NULL && opts->processes > 0)
+    return exec_processes(source, map, reduce, reducer_count, output, opts,
+                          spill_dir);
+
+  // The pool only grows, but a job runs on no more workers than it asks for;
+  // reducer_count still sets the number of partitions.
+  size_t threads = mapper_count > reducer_count ? mapper_count : reducer_count;
+  size_t workers = workpool_start(threads);
+  if (workers > threads)
+    workers = threads;
+  if (workers == 0)
+    return -1;
+
+  // Spill mode already moves sorted runs out of memory as they fill up.
+  int pipelined = opts != NULL && opts->pipeline && budget == 0;
+  struct kv_buffer *parts = calloc(workers * reducer_count, sizeof(*parts));
+  struct map_output *outputs = calloc(workers, sizeof(*outputs));
+  struct kv_buffer *outs = calloc(reducer_count, sizeof(*outs));
+  struct pipe_part *pipe =
+      pipelined ? calloc(reducer_count, sizeof(*pipe)) : NULL;
+  struct worker_stats *wstats =
+      stats != NULL ? calloc(workers, sizeof(*wstats)) : NULL;
+  struct mr_stats st = {0};
+  double start = now_sec(), mark = start;
+  int ret = -1;
+  for (size_t i = 0; outputs != NULL && i < workers; ++i)
+    outputs[i].spill_fd = -1;
+  for (size_t i = 0; pipe != NULL && i < reducer_count; ++i)
+    pthread_mutex_init(&pipe[i].lock, NULL);
+  if (parts == NULL || outputs == NULL || outs == NULL ||
+      (pipelined && pipe == NULL) || (stats != NULL && wstats == NULL))
+    goto out;
+  for (size_t i = 0; i < workers * reducer_count; ++i)
+    parts[i].combine_at = COMBINE_BATCH;
+  for (size_t i = 0; i < workers; ++i) {
+    outputs[i].combine = combine;
+    outputs[i].parts = parts + i * reducer_count;
+    outputs[i].part_count = reducer_count;
+    outputs[i].sort = sort;
+    outputs[i].budget = (budget + workers - 1) / workers;
+    outputs[i].spill_dir = spill_dir;
   }
 
-  output->count = final_count;
-  output->kv_lst = calloc(final_count, sizeof(struct mr_out_kv));
-  for (size_t i = 0; i < final_count; ++i) {
-    strncpy(output->kv_lst[i].key, final_buffer[i].key, MAX_KEY_SIZE);
-    output->kv_lst[i].key[MAX_KEY_SIZE - 1] = '\0';
-    output->kv_lst[i].count = 1; // groups[i].value_count;
-    output->kv_lst[i].value = malloc(MAX_VALUE_SIZE);
-    strncpy(output->kv_lst[i].value[0], final_buffer[i].value, MAX_VALUE_SIZE);
-    output->kv_lst[i].value[0][MAX_VALUE_SIZE - 1] = '\0';
-    /*output->kv_lst[i].value = malloc(groups[i].value_count * MAX_VALUE_SIZE);
-    for (size_t j = 0; j < groups[i].value_count; ++j) {
-      strncpy(output->kv_lst[i].value[j], groups[i].values[j], MAX_VALUE_SIZE);
-      output->kv_lst[i].value[j][MAX_VALUE_SIZE - 1] = '\0';
-    }*/
+  struct map_job map_job = {source, map, outputs, pipe, wstats};
+  if (workpool_run_on(workers, map_task, &map_job, source->splits) != 0)
+    goto out;
+  st.map_sec = lap(&mark);
+  if (combine != NULL && !pipelined &&
+      workpool_run_on(workers, combine_task, &map_job,
+                      workers * reducer_count) != 0)
+    goto out;
+  st.combine_sec = lap(&mark);
+
+  for (size_t i = 0; i < workers; ++i) {
+    if (outputs[i].failed)
+      goto out;
   }
 
-  qsort(output->kv_lst, output->count, sizeof(struct mr_out_kv), outcompare);
+  struct reduce_job reduce_job = {outputs, workers, reduce, outs, sort, 0,
+                                  pipe, wstats, outputs[0].budget, spill_dir};
+  if (workpool_run_on(workers, reduce_task, &reduce_job, reducer_count) != 0 ||
+      reduce_job.failed)
+    goto out;
+  st.reduce_sec = lap(&mark);
 
-  for (size_t i = 0; i < group_count; ++i) {
-    for (size_t k = 0; k < groups[i].value_count; ++k) {
-      free(groups[i].values[k]);
+  collect_output(outs, reducer_count, output, workers);
+  st.output_sec = lap(&mark);
+  if (stats != NULL) {
+    st.total_sec = now_sec() - start;
+    st.threads = workers;
+    for (size_t i = 0; i < workers; ++i) {
+      st.sort_sec += wstats[i].sort;
+      st.group_sec += wstats[i].group;
+      st.reduce_fn_sec += wstats[i].reduce;
+      st.input_records += wstats[i].records;
+      st.map_pairs += wstats[i].pairs;
+      st.map_bytes += wstats[i].bytes;
+      st.groups += wstats[i].groups;
+      st.reduce_values += wstats[i].values;
+      st.spill_bytes += outputs[i].spill_size;
+      if (i < MR_STATS_MAX_THREADS)
+        st.busy_sec[i] = wstats[i].busy;
     }
-    free(groups[i].values);
+    st.output_pairs = output->count;
+    *stats = st;
   }
-  return 0;
+  ret = 0;
+
+out:
+  if (parts != NULL) {
+    for (size_t i = 0; i < workers * reducer_count; ++i)
+      kv_buffer_free(&parts[i]);
+  }
+  if (outs != NULL) {
+    for (size_t i = 0; i < reducer_count; ++i)
+      kv_buffer_free(&outs[i]);
+  }
+  if (outputs != NULL) {
+    for (size_t i = 0; i < workers; ++i) {
+      if (outputs[i].spill_fd >= 0)
+        close(outputs[i].spill_fd);
+      free(outputs[i].runs);
+    }
+  }
+  for (size_t i = 0; pipe != NULL && i < reducer_count; ++i) {
+    for (size_t r = 0; r < pipe[i].count; ++r) {
+      free(pipe[i].runs[r].pairs);
+      arena_free(&pipe[i].runs[r].arena);
+    }
+    free(pipe[i].runs);
+    pthread_mutex_destroy(&pipe[i].lock);
+  }
+  free(parts);
+  free(outputs);
+  free(outs);
+  free(pipe);
+  free(wstats);
+  return ret;
+}
+
+int mr_exec(const struct mr_input *input, void (*map)(const struct mr_in_kv *),
+            size_t mapper_count, void (*reduce)(const struct mr_out_kv *),
+            size_t reducer_count, struct mr_output *output) {
+  return mr_exec_ex(input, map, mapper_count, reduce, reducer_count, output,
+                    NULL);
 }
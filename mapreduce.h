@@ -0,0 +1,113 @@
+// Extensions to the mr_exec API from interface.h.
+#ifndef MAPREDUCE_H
+#define MAPREDUCE_H
+
+#include "interface.h"
+
+// How each partition is sorted by key before reduce (and combine) see it.
+// All give the same groups; they differ only in speed, see mr_bench.c.
+enum mr_sort {
+  MR_SORT_RADIX,    // MSD radix sort on key bytes, the default
+  MR_SORT_MULTIKEY, // multikey (three-way radix) quicksort on key bytes
+  MR_SORT_QSORT,    // comparison sort on key prefixes, full compare on ties
+};
+
+// Busy times kept per worker in mr_stats.
+#define MR_STATS_MAX_THREADS 64
+
+// Where a job's time went, filled in when mr_options.stats is set.
+struct mr_stats {
+  // Wall-clock seconds per phase. Map includes sorting runs in pipelined
+  // mode; combine is the pass over each mapper's output after map; output
+  // is copying the final pairs out and sorting them.
+  double map_sec;
+  double combine_sec;
+  double reduce_sec;
+  double output_sec;
+  double total_sec;
+  // Seconds summed over the reduce tasks: sorting partitions, grouping
+  // (copying values, plus merging runs in spill and pipelined modes) and
+  // inside reduce itself.
+  double sort_sec;
+  double group_sec;
+  double reduce_fn_sec;
+  size_t input_records;
+  size_t map_pairs; // emitted by map, before any combining
+  size_t map_bytes; // their key and value bytes
+  size_t spill_bytes;
+  size_t groups;        // reduce calls
+  size_t reduce_values; // values they got, fewer than map_pairs if combined
+  size_t output_pairs;
+  size_t threads; // workers, or processes, the job ran on
+  // Seconds each worker spent running map, combine and reduce tasks.
+  double busy_sec[MR_STATS_MAX_THREADS];
+};
+
+struct mr_options {
+  // Optional combiner. Called on a mapper's own output, once per key, with
+  // the same grouped view reduce gets; it emits the pre-aggregated pairs with
+  // mr_emit_i. Only valid when reduce gives the same result on combined
+  // values, e.g. sums and counts. May run several times per mapper.
+  void (*combine)(const struct mr_out_kv *);
+  enum mr_sort sort;
+  // Spill mode, off when 0. Map output buffered in memory is kept to about
+  // this many bytes in total; beyond that each worker sorts its buffers
+  // and writes them to disk as runs, which reduce then merges back in a
+  // streaming k-way merge. Only one key's values are held at a time there,
+  // and the merge's read buffers stay within the budget too, merging runs
+  // in extra passes when there are too many to read at once.
+  size_t memory_budget;
+  // Directory for spill files; NULL means $TMPDIR, or /tmp without it.
+  const char *spill_dir;
+  // Multi-process mode, off when 0. The job runs in this many forked worker
+  // processes instead of threads, with mapper_count unused; they exchange
+  // data through files under spill_dir. A task whose process dies, say
+  // from a crash in map or reduce, is run again in a fresh process, up to
+  // three times.
+  size_t processes;
+  // Multi-process mode: seconds a task may take before its process is taken
+  // to be hung, killed and the task run again; 0 means ten minutes.
+  double task_timeout;
+  // Pipelined mode. Each map task sorts its own output into runs as soon
+  // as it finishes, and runs are merged while the other mappers are still
+  // going, so all that is left after the last mapper is one streaming merge
+  // per partition instead of a sort. Has no effect in spill mode.
+  int pipeline;
+  // Optional. Collects the job's mr_stats here; in multi-process mode only
+  // the phase times, threads and output_pairs are filled in.
+  struct mr_stats *stats;
+};
+
+// mr_exec with options; opts may be NULL for the defaults.
+int mr_exec_ex(const struct mr_input *input,
+               void (*map)(const struct mr_in_kv *), size_t mapper_count,
+               void (*reduce)(const struct mr_out_kv *), size_t reducer_count,
+               struct mr_output *output, const struct mr_options *opts);
+
+// Map input read in splits instead of from a materialized mr_input. Map
+// tasks run read() concurrently, one split each, and it calls map once per
+// record of the split; it returns 0, or -1 to fail the job.
+struct mr_source {
+  size_t splits;
+  int (*read)(void *ctx, size_t split, void (*map)(const struct mr_in_kv *));
+  void *ctx;
+};
+
+// mr_exec_ex over a source.
+int mr_exec_source(const struct mr_source *source,
+                   void (*map)(const struct mr_in_kv *), size_t mapper_count,
+                   void (*reduce)(const struct mr_out_kv *),
+                   size_t reducer_count, struct mr_output *output,
+                   const struct mr_options *opts);
+
+// Maps the file at path as a source of records ended by delim ('\n' for
+// lines), split_size bytes per split (0 for 1 MiB). Each record is mapped
+// with its byte offset as the key and its bytes, without delim, as the value.
+// A record longer than MAX_VALUE_SIZE - 1 bytes is mapped as consecutive
+// pieces of at most that many bytes, each keyed by its own offset, in order
+// and by the same thread. Returns -1 if the file can't be mapped.
+int mr_source_open(struct mr_source *source, const char *path, char delim,
+                   size_t split_size);
+void mr_source_close(struct mr_source *source);
+
+#endif
@@ -0,0 +1,620 @@
+// Benchmarks for mapreduce.c.
+//
+// First runs a word count over generated text with uniformly distributed and
+// Zipf-distributed words once per partition sort (see enum mr_sort), checks
+// that every run produces the same output and reports the time of each.
+// Then runs word count, inverted index and join workloads at two input sizes
+// and 1, 2, 4, ... threads, checking each output against the one-thread run
+// and breaking the time down by phase with mr_stats. Last, runs word count in
+// each execution mode and from a file and checks it against the default mode,
+// and checks that a file source hands map every byte of long records.
+//   gcc -O2 -pthread mr_bench.c mapreduce.c -o mr_bench -lm
+//   ./mr_bench [records] [max_threads]
+#define _POSIX_C_SOURCE 200809L
+#include "mapreduce.h"
+#include <fcntl.h>
+#include <math.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define WORDS_PER_RECORD 16
+
+static const char *sort_names[] = {"radix", "multikey", "qsort"};
+
+static double now_sec(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint64_t rng_state = 88172645463325252ull;
+
+static uint64_t rng(void) {
+  rng_state ^= rng_state << 13;
+  rng_state ^= rng_state >> 7;
+  rng_state ^= rng_state << 17;
+  return rng_state;
+}
+
+static void map_words(const struct mr_in_kv *kv) {
+  char line[MAX_VALUE_SIZE];
+  strcpy(line, kv->value);
+  char *save = NULL;
+  for (char *w = strtok_r(line, " ", &save); w != NULL;
+       w = strtok_r(NULL, " ", &save)) {
+    if (mr_emit_i(w, "1") != 0) {
+      fprintf(stderr, "mr_emit_i failed\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+}
+
+static void emit_final(const char *key, const char *value) {
+  if (mr_emit_f(key, value) != 0) {
+    fprintf(stderr, "mr_emit_f failed\n");
+    exit(EXIT_FAILURE);
+  }
+}
+
+static void reduce_count(const struct mr_out_kv *kv) {
+  long sum = 0;
+  for (size_t i = 0; i < kv->count; i++)
+    sum += atol(kv->value[i]);
+  char value[32];
+  snprintf(value, sizeof(value), "%ld", sum);
+  emit_final(kv->key, value);
+}
+
+// reduce_count as a combiner: the partial sums go back into the map output.
+static void combine_count(const struct mr_out_kv *kv) {
+  long sum = 0;
+  for (size_t i = 0; i < kv->count; i++)
+    sum += atol(kv->value[i]);
+  char value[32];
+  snprintf(value, sizeof(value), "%ld", sum);
+  if (mr_emit_i(kv->key, value) != 0) {
+    fprintf(stderr, "mr_emit_i failed\n");
+    exit(EXIT_FAILURE);
+  }
+}
+
+// Inverted index: word -> the documents (records) it occurs in.
+static void map_index(const struct mr_in_kv *kv) {
+  char line[MAX_VALUE_SIZE];
+  strcpy(line, kv->value);
+  char *save = NULL;
+  for (char *w = strtok_r(line, " ", &save); w != NULL;
+       w = strtok_r(NULL, " ", &save)) {
+    if (mr_emit_i(w, kv->key) != 0) {
+      fprintf(stderr, "mr_emit_i failed\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+}
+
+static int cmp_ulong(const void *a, const void *b) {
+  unsigned long x = *(const unsigned long *)a, y = *(const unsigned long *)b;
+  return (x > y) - (x < y);
+}
+
+// Emits the posting count and as much of the sorted posting list as fits.
+static void reduce_postings(const struct mr_out_kv *kv) {
+  unsigned long *docs = malloc(kv->count * sizeof(*docs));
+  for (size_t i = 0; i < kv->count; i++)
+    docs[i] = strtoul(kv->value[i], NULL, 10);
+  qsort(docs, kv->count, sizeof(*docs), cmp_ulong);
+  char value[MAX_VALUE_SIZE];
+  int len = snprintf(value, sizeof(value), "%zu:", kv->count);
+  for (size_t i = 0; i < kv->count; i++) {
+    char doc[24];
+    int n = snprintf(doc, sizeof(doc), "%s%lu", i ? "," : "", docs[i]);
+    if (len + n >= MAX_VALUE_SIZE)
+      break;
+    memcpy(value + len, doc, n + 1);
+    len += n;
+  }
+  free(docs);
+  emit_final(kv->key, value);
+}
+
+// Join of customers ("C <id> <name>") with their orders ("O <id> <amount>")
+// on the customer id.
+static void map_join(const struct mr_in_kv *kv) {
+  char table, rest[64];
+  unsigned long id;
+  if (sscanf(kv->value, "%c %lu %63s", &table, &id, rest) != 3)
+    return;
+  char key[MAX_KEY_SIZE], value[MAX_VALUE_SIZE];
+  snprintf(key, sizeof(key), "%lu", id);
+  snprintf(value, sizeof(value), "%c%s", table, rest);
+  if (mr_emit_i(key, value) != 0) {
+    fprintf(stderr, "mr_emit_i failed\n");
+    exit(EXIT_FAILURE);
+  }
+}
+
+// Emits the number of joined rows and the total order amount.
+static void reduce_join(const struct mr_out_kv *kv) {
+  long customers = 0, orders = 0, amount = 0;
+  for (size_t i = 0; i < kv->count; i++) {
+    if (kv->value[i][0] == 'C') {
+      customers++;
+    } else {
+      orders++;
+      amount += atol(kv->value[i] + 1);
+    }
+  }
+  char value[64];
+  snprintf(value, sizeof(value), "%ld %ld", customers * orders,
+           customers * amount);
+  emit_final(kv->key, value);
+}
+
+// Random lower-case words of 3 to 14 letters; the generated text draws word
+// indices from them, so the vocabulary sets the number of distinct keys.
+static char (*make_vocab(size_t n))[16] {
+  char (*vocab)[16] = malloc(n * sizeof(*vocab));
+  for (size_t i = 0; i < n; i++) {
+    int len = 3 + rng() % 12;
+    for (int k = 0; k < len; k++)
+      vocab[i][k] = 'a' + rng() % 26;
+    vocab[i][len] = '\0';
+  }
+  return vocab;
+}
+
+// Inverse CDF sampling for P(rank k) proportional to 1 / k^s.
+struct zipf {
+  double *cdf;
+  size_t n;
+};
+
+static struct zipf zipf_init(size_t n, double s) {
+  struct zipf z = {malloc(n * sizeof(double)), n};
+  double sum = 0;
+  for (size_t k = 0; k < n; k++) {
+    sum += 1.0 / pow(k + 1, s);
+    z.cdf[k] = sum;
+  }
+  for (size_t k = 0; k < n; k++)
+    z.cdf[k] /= sum;
+  return z;
+}
+
+static size_t zipf_sample(const struct zipf *z) {
+  double u = (rng() >> 11) * (1.0 / 9007199254740992.0);
+  size_t lo = 0, hi = z->n - 1;
+  while (lo < hi) {
+    size_t mid = (lo + hi) / 2;
+    if (z->cdf[mid] < u)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+static void make_text(struct mr_input *in, size_t records, char (*vocab)[16],
+                      size_t vocab_size, const struct zipf *z) {
+  in->count = records;
+  in->kv_lst = calloc(records, sizeof(struct mr_in_kv));
+  for (size_t i = 0; i < records; i++) {
+    struct mr_in_kv *kv = &in->kv_lst[i];
+    snprintf(kv->key, MAX_KEY_SIZE, "%zu", i);
+    size_t len = 0;
+    for (int w = 0; w < WORDS_PER_RECORD; w++) {
+      size_t idx = z ? zipf_sample(z) : rng() % vocab_size;
+      size_t wlen = strlen(vocab[idx]);
+      if (len + wlen + 2 > MAX_VALUE_SIZE)
+        break;
+      if (len > 0)
+        kv->value[len++] = ' ';
+      memcpy(kv->value + len, vocab[idx], wlen + 1);
+      len += wlen;
+    }
+  }
+}
+
+// One customer row per id, then orders whose customer ids follow z, so a
+// few customers have most of the orders.
+static void make_join(struct mr_input *in, size_t records,
+                      const struct zipf *z) {
+  size_t customers = records / 8 ? records / 8 : 1;
+  in->count = records;
+  in->kv_lst = calloc(records, sizeof(struct mr_in_kv));
+  for (size_t i = 0; i < records; i++) {
+    struct mr_in_kv *kv = &in->kv_lst[i];
+    snprintf(kv->key, MAX_KEY_SIZE, "%zu", i);
+    if (i < customers)
+      snprintf(kv->value, MAX_VALUE_SIZE, "C %zu customer%zu", i, i);
+    else
+      snprintf(kv->value, MAX_VALUE_SIZE, "O %zu %u",
+               zipf_sample(z) % customers, (unsigned)(1 + rng() % 1000));
+  }
+}
+
+static void free_output(struct mr_output *out) {
+  for (size_t i = 0; i < out->count; i++)
+    free(out->kv_lst[i].value);
+  free(out->kv_lst);
+}
+
+static int same_output(const struct mr_output *a, const struct mr_output *b) {
+  if (a->count != b->count)
+    return 0;
+  for (size_t i = 0; i < a->count; i++) {
+    if (strcmp(a->kv_lst[i].key, b->kv_lst[i].key) != 0 ||
+        strcmp(a->kv_lst[i].value[0], b->kv_lst[i].value[0]) != 0)
+      return 0;
+  }
+  return 1;
+}
+
+static int bench(const char *name, const struct mr_input *in, size_t threads) {
+  printf("\n%s: %zu records, %zu threads\n", name, in->count, threads);
+  printf("%-10s %10s %10s\n", "sort", "seconds", "keys");
+  struct mr_output ref = {0};
+  for (int sort = 0; sort < 3; sort++) {
+    struct mr_options opts = {0};
+    opts.sort = sort;
+    struct mr_output out;
+    double start = now_sec();
+    if (mr_exec_ex(in, map_words, threads, reduce_count, threads, &out,
+                   &opts) != 0) {
+      fprintf(stderr, "mr_exec_ex failed\n");
+      return -1;
+    }
+    double sec = now_sec() - start;
+    int ok = sort == 0 || same_output(&ref, &out);
+    printf("%-10s %10.3f %10zu%s\n", sort_names[sort], sec, out.count,
+           ok ? "" : "  MISMATCH");
+    if (sort == 0)
+      ref = out;
+    else
+      free_output(&out);
+    if (!ok)
+      return -1;
+  }
+  free_output(&ref);
+  return 0;
+}
+
+struct workload {
+  const char *name;
+  void (*map)(const struct mr_in_kv *);
+  void (*reduce)(const struct mr_out_kv *);
+  void (*combine)(const struct mr_out_kv *); // NULL if reduce can't be one
+  struct mr_input in;
+};
+
+static void print_stats(const char *name, size_t records,
+                        const struct mr_stats *st, int ok) {
+  double busy_max = 0, busy_sum = 0;
+  for (size_t i = 0; i < st->threads && i < MR_STATS_MAX_THREADS; i++) {
+    busy_sum += st->busy_sec[i];
+    if (st->busy_sec[i] > busy_max)
+      busy_max = st->busy_sec[i];
+  }
+  double imbalance = busy_sum > 0 ? busy_max * st->threads / busy_sum : 0;
+  printf("%-9s %8zu %3zu %7.3f %7.3f %7.3f %7.3f %7.3f %7.3f %7.3f %7.3f"
+         " %5.2f %9zu %7.1f %8zu%s\n",
+         name, records, st->threads, st->total_sec, st->map_sec,
+         st->combine_sec, st->reduce_sec, st->sort_sec, st->group_sec,
+         st->reduce_fn_sec, st->output_sec, imbalance, st->map_pairs,
+         st->map_bytes / 1e6, st->output_pairs, ok ? "" : "  MISMATCH");
+}
+
+// Runs w on its first `records` records with 1, 2, 4, ... threads.
+static int run_suite(const struct workload *w, size_t records,
+                     size_t max_threads) {
+  struct mr_input in = {w->in.kv_lst, records};
+  struct mr_output ref = {0};
+  for (size_t t = 1;; t *= 2) {
+    if (t > max_threads)
+      t = max_threads;
+    struct mr_stats st;
+    struct mr_options opts = {0};
+    opts.stats = &st;
+    struct mr_output out;
+    if (mr_exec_ex(&in, w->map, t, w->reduce, t, &out, &opts) != 0) {
+      fprintf(stderr, "mr_exec_ex failed\n");
+      return -1;
+    }
+    int ok = t == 1 || same_output(&ref, &out);
+    print_stats(w->name, records, &st, ok);
+    if (t == 1)
+      ref = out;
+    else
+      free_output(&out);
+    if (!ok)
+      return -1;
+    if (t >= max_threads)
+      break;
+  }
+  free_output(&ref);
+  return 0;
+}
+
+static void print_mode(const char *name, const struct mr_stats *st,
+                       double base_sec, int ok) {
+  printf("%-9s %7.3f %7.3f %7.3f %8.1f %8zu %6.2f%s\n", name, st->total_sec,
+         st->map_sec, st->reduce_sec, st->spill_bytes / 1e6, st->output_pairs,
+         base_sec / st->total_sec, ok ? "" : "  MISMATCH");
+}
+
+// Writes size bytes of data to a new temporary file and leaves its name in
+// path, which must hold at least 64 bytes.
+static int write_temp(const char *data, size_t size, char *path) {
+  const char *dir = getenv("TMPDIR");
+  snprintf(path, 64, "%.40s/mr_bench.XXXXXX", dir != NULL ? dir : "/tmp");
+  int fd = mkstemp(path);
+  if (fd < 0) {
+    perror("mkstemp");
+    return -1;
+  }
+  FILE *f = fdopen(fd, "w");
+  int ok = f != NULL && fwrite(data, 1, size, f) == size;
+  if (f == NULL)
+    close(fd);
+  if ((f != NULL && fclose(f) != 0) || !ok) {
+    perror(path);
+    unlink(path);
+    return -1;
+  }
+  return 0;
+}
+
+// Runs w with opts, reading its input from source if that is not NULL, and
+// checks the output against ref, the default run.
+static int run_mode(const char *name, const struct workload *w,
+                    const struct mr_source *source, size_t threads,
+                    struct mr_options *opts, const struct mr_output *ref,
+                    double base_sec) {
+  struct mr_stats st;
+  opts->stats = &st;
+  struct mr_output out;
+  int ret = source != NULL
+                ? mr_exec_source(source, w->map, threads, w->reduce, threads,
+                                 &out, opts)
+                : mr_exec_ex(&w->in, w->map, threads, w->reduce, threads, &out,
+                             opts);
+  if (ret != 0) {
+    fprintf(stderr, "%s: mr_exec failed\n", name);
+    return -1;
+  }
+  int ok = same_output(ref, &out);
+  print_mode(name, &st, base_sec, ok);
+  if (opts->combine != NULL)
+    printf("%-9s %zu map pairs, %zu after combining\n", "", st.map_pairs,
+           st.reduce_values);
+  free_output(&out);
+  return ok ? 0 : -1;
+}
+
+// For the multi-process run: the first worker process to map crash_record
+// kills itself and the first to map hang_record stops for good, so both map
+// tasks have to be run again in fresh processes.
+static void (*crash_map)(const struct mr_in_kv *);
+static size_t crash_record, hang_record;
+static char crash_marker[64], hang_marker[64];
+static pid_t bench_pid;
+
+static void map_crash_once(const struct mr_in_kv *kv) {
+  size_t record = strtoull(kv->key, NULL, 10);
+  if (getpid() != bench_pid && record == crash_record &&
+      open(crash_marker, O_CREAT | O_EXCL | O_WRONLY, 0600) >= 0)
+    raise(SIGKILL);
+  if (getpid() != bench_pid && record == hang_record &&
+      open(hang_marker, O_CREAT | O_EXCL | O_WRONLY, 0600) >= 0)
+    raise(SIGSTOP);
+  crash_map(kv);
+}
+
+// Runs w once per execution mode (see mr_options) and checks that each gives
+// the same output as the default in-memory run. The last run reads w's input
+// back from a file with mr_source_open, so w->map must ignore the key.
+static int run_modes(const struct workload *w, size_t threads) {
+  printf("\n%s: %zu records, %zu threads\n", w->name, w->in.count, threads);
+  printf("%-9s %7s %7s %7s %8s %8s %6s\n", "mode", "total", "map", "reduce",
+         "spill MB", "keys", "speed");
+  struct mr_stats base;
+  struct mr_options opts = {0};
+  opts.stats = &base;
+  struct mr_output ref;
+  if (mr_exec_ex(&w->in, w->map, threads, w->reduce, threads, &ref, &opts) !=
+      0) {
+    fprintf(stderr, "default: mr_exec_ex failed\n");
+    return -1;
+  }
+  print_mode("default", &base, base.total_sec, 1);
+
+  // An eighth of the map output as the budget makes every worker spill
+  // several runs.
+  opts = (struct mr_options){0};
+  opts.memory_budget = base.map_bytes / 8 + 1;
+  int failed =
+      run_mode("spill", w, NULL, threads, &opts, &ref, base.total_sec) != 0;
+
+  opts = (struct mr_options){0};
+  opts.pipeline = 1;
+  failed = failed || run_mode("pipeline", w, NULL, threads, &opts, &ref,
+                              base.total_sec) != 0;
+
+  // The combiner on its own, and with spilling and pipelining, where it only
+  // sees what a mapper has not yet spilled or handed on.
+  if (w->combine != NULL) {
+    const char *names[] = {"combine", "c+spill", "c+pipe"};
+    for (int k = 0; k < 3 && !failed; k++) {
+      opts = (struct mr_options){0};
+      opts.combine = w->combine;
+      opts.memory_budget = k == 1 ? base.map_bytes / 8 + 1 : 0;
+      opts.pipeline = k == 2;
+      failed = run_mode(names[k], w, NULL, threads, &opts, &ref,
+                        base.total_sec) != 0;
+    }
+  }
+
+  struct workload crashing = *w;
+  crashing.map = map_crash_once;
+  crash_map = w->map;
+  crash_record = w->in.count / 2;
+  hang_record = w->in.count / 4;
+  bench_pid = getpid();
+  if (!failed && write_temp("", 0, crash_marker) == 0 &&
+      write_temp("", 0, hang_marker) == 0) {
+    unlink(crash_marker);
+    unlink(hang_marker);
+    // Well over a map task's time here, but it still counts in the total.
+    opts = (struct mr_options){0};
+    opts.processes = threads;
+    opts.task_timeout = 1;
+    failed = run_mode("processes", &crashing, NULL, threads, &opts, &ref,
+                      base.total_sec) != 0;
+    if (!failed && access(crash_marker, F_OK) != 0) {
+      fprintf(stderr, "processes: no worker was killed\n");
+      failed = 1;
+    }
+    if (!failed && access(hang_marker, F_OK) != 0) {
+      fprintf(stderr, "processes: no worker hung\n");
+      failed = 1;
+    }
+    unlink(crash_marker);
+    unlink(hang_marker);
+  } else {
+    unlink(crash_marker);
+    failed = 1;
+  }
+
+  // Splits far smaller than the file leave many records crossing a split
+  // boundary.
+  size_t size = 0;
+  for (size_t i = 0; i < w->in.count; i++)
+    size += strlen(w->in.kv_lst[i].value) + 1;
+  char *text = malloc(size + 1), path[64];
+  size = 0;
+  for (size_t i = 0; text != NULL && i < w->in.count; i++)
+    size += sprintf(text + size, "%s\n", w->in.kv_lst[i].value);
+  struct mr_source source;
+  if (failed || text == NULL || write_temp(text, size, path) != 0) {
+    failed = 1;
+  } else {
+    if (mr_source_open(&source, path, '\n', 4096) != 0) {
+      fprintf(stderr, "%s: mr_source_open failed\n", path);
+      failed = 1;
+    } else {
+      opts = (struct mr_options){0};
+      failed = run_mode("file", w, &source, threads, &opts, &ref,
+                        base.total_sec) != 0;
+      mr_source_close(&source);
+    }
+    unlink(path);
+  }
+  free(text);
+  free_output(&ref);
+  return failed ? -1 : 0;
+}
+
+// File source check: records up to several times MAX_VALUE_SIZE, some longer
+// than a split, must reach map as pieces that match the file at their offsets
+// and together cover every byte of every record exactly once.
+static const char *piece_text;
+static size_t piece_size;
+
+static void map_pieces(const struct mr_in_kv *kv) {
+  size_t off = strtoull(kv->key, NULL, 10), len = strlen(kv->value);
+  int ok = off + len <= piece_size &&
+           memcmp(piece_text + off, kv->value, len) == 0 &&
+           (off + len == piece_size || piece_text[off + len] == '\n' ||
+            len == MAX_VALUE_SIZE - 1);
+  char value[32];
+  snprintf(value, sizeof(value), "%zu", len);
+  if (mr_emit_i(ok ? "bytes" : "bad", value) != 0) {
+    fprintf(stderr, "mr_emit_i failed\n");
+    exit(EXIT_FAILURE);
+  }
+}
+
+static int check_pieces(size_t records, size_t threads) {
+  size_t cap = records * 3001, size = 0, lines = 0;
+  char *text = malloc(cap), path[64];
+  if (text == NULL)
+    return -1;
+  for (size_t i = 0; i < records; i++) {
+    uint64_t r = rng();
+    size_t len = r % 8 < 5 ? r % 100 : r % 8 < 7 ? r % 800 : 1000 + r % 2000;
+    for (size_t j = 0; j < len; j++)
+      text[size++] = 'a' + rng() % 26;
+    text[size++] = '\n';
+    lines++;
+  }
+  piece_text = text;
+  piece_size = size;
+  struct mr_source source;
+  struct mr_output out = {0};
+  int ok = 0;
+  if (write_temp(text, size, path) == 0) {
+    if (mr_source_open(&source, path, '\n', 1024) == 0) {
+      if (mr_exec_source(&source, map_pieces, threads, reduce_count, threads,
+                         &out, NULL) == 0) {
+        ok = out.count == 1 && strcmp(out.kv_lst[0].key, "bytes") == 0 &&
+             strtoull(out.kv_lst[0].value[0], NULL, 10) == size - lines;
+        free_output(&out);
+      }
+      mr_source_close(&source);
+    }
+    unlink(path);
+  }
+  printf("\nfile source: %zu records, %zu bytes, split 1024: %s\n", records,
+         size, ok ? "ok" : "MISMATCH");
+  free(text);
+  return ok ? 0 : -1;
+}
+
+int main(int argc, char *argv[]) {
+  size_t records = argc > 1 ? strtoull(argv[1], NULL, 10) : 200000;
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+  size_t threads = argc > 2 ? strtoull(argv[2], NULL, 10)
+                            : (size_t)(cores > 0 ? cores : 1);
+  size_t vocab_size = 100000;
+  char (*vocab)[16] = make_vocab(vocab_size);
+  struct zipf z = zipf_init(vocab_size, 1.0);
+
+  struct mr_input uniform, zipfian;
+  make_text(&uniform, records, vocab, vocab_size, NULL);
+  make_text(&zipfian, records, vocab, vocab_size, &z);
+  int failed = bench("uniform words", &uniform, threads) != 0 ||
+               bench("zipf words (s = 1.0)", &zipfian, threads) != 0;
+
+  // Seconds: total, then per phase (map, combine, reduce, output); sort,
+  // group and reduce() are summed over the reduce tasks. Imbalance is the
+  // busiest thread's busy time over the mean.
+  struct workload suite[3] = {
+      {"wordcount", map_words, reduce_count, combine_count, zipfian},
+      {"index", map_index, reduce_postings, NULL, zipfian},
+      {"join", map_join, reduce_join, NULL, {0}}};
+  make_join(&suite[2].in, records, &z);
+  printf("\n%-9s %8s %3s %7s %7s %7s %7s %7s %7s %7s %7s %5s %9s %7s %8s\n",
+         "workload", "records", "thr", "total", "map", "combine", "reduce",
+         "sort", "group", "reduce()", "output", "imbal", "pairs", "MB",
+         "keys");
+  for (int i = 0; i < 3 && !failed; i++) {
+    failed = run_suite(&suite[i], records / 4, threads) != 0 ||
+             run_suite(&suite[i], records, threads) != 0;
+  }
+
+  // Speed is relative to the default mode.
+  failed = failed || run_modes(&suite[0], threads) != 0 ||
+           check_pieces(2000, threads) != 0;
+
+  free(uniform.kv_lst);
+  free(zipfian.kv_lst);
+  free(suite[2].in.kv_lst);
+  free(z.cdf);
+  free(vocab);
+  return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
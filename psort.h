@@ -0,0 +1,136 @@
+// Parallel sort for large arrays, built on workpool.h.
+//
+// The array is cut into one run per thread and the runs are qsorted
+// concurrently. Pairs of runs are then merged round by round; every merge is
+// split along its merge path into independent slices, so all threads keep
+// working even in the last round, where a single pair is left. The merge
+// takes from the left run on ties, but the run sorts are qsort, so like qsort
+// the result is not stable.
+#ifndef PSORT_H
+#define PSORT_H
+
+#include "workpool.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Below this many elements per thread the fork/merge overhead outweighs the
+// gain and psort is just qsort.
+#define PSORT_MIN_PER_THREAD 4096
+// Merge slices per thread and round; a few extra let stealing absorb
+// slices that happen to be slower.
+#define PSORT_SLICES_PER_THREAD 4
+
+struct psort_job {
+  char *src;
+  char *dst;
+  size_t size;
+  int (*cmp)(const void *, const void *);
+  size_t *bounds; // run i is [bounds[i], bounds[i + 1])
+  size_t runs;
+  size_t slices; // per merged pair
+};
+
+static void psort_run_task(void *arg, size_t i) {
+  struct psort_job *job = arg;
+  qsort(job->src + job->bounds[i] * job->size,
+        job->bounds[i + 1] - job->bounds[i], job->size, job->cmp);
+}
+
+// Number of elements of a that precede output position d when a and b are
+// merged, a's elements going first on ties.
+static size_t psort_merge_path(const char *a, size_t na, const char *b,
+                               size_t nb, size_t d, size_t size,
+                               int (*cmp)(const void *, const void *)) {
+  size_t lo = d > nb ? d - nb : 0;
+  size_t hi = d < na ? d : na;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (cmp(a + mid * size, b + (d - mid - 1) * size) <= 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+static void psort_merge_task(void *arg, size_t task) {
+  struct psort_job *job = arg;
+  size_t pair = task / job->slices, slice = task % job->slices;
+  size_t first = pair * 2, size = job->size;
+  size_t start = job->bounds[first];
+  size_t mid = job->bounds[first + 1];
+  size_t end = first + 2 <= job->runs ? job->bounds[first + 2] : mid;
+  const char *a = job->src + start * size, *b = job->src + mid * size;
+  size_t na = mid - start, nb = end - mid, total = na + nb;
+
+  size_t d0 = total * slice / job->slices;
+  size_t d1 = total * (slice + 1) / job->slices;
+  size_t i = psort_merge_path(a, na, b, nb, d0, size, job->cmp);
+  size_t i_end = psort_merge_path(a, na, b, nb, d1, size, job->cmp);
+  size_t j = d0 - i, j_end = d1 - i_end;
+  char *out = job->dst + (start + d0) * size;
+  while (i < i_end && j < j_end) {
+    if (job->cmp(a + i * size, b + j * size) <= 0)
+      memcpy(out, a + i++ * size, size);
+    else
+      memcpy(out, b + j++ * size, size);
+    out += size;
+  }
+  memcpy(out, a + i * size, (i_end - i) * size);
+  out += (i_end - i) * size;
+  memcpy(out, b + j * size, (j_end - j) * size);
+}
+
+// Sorts like qsort using up to `threads` pool workers. Falls back to qsort
+// for small inputs, when called from a pool task, or when memory for the
+// merge buffer is not available.
+static void psort(void *base, size_t n, size_t size,
+                  int (*cmp)(const void *, const void *), size_t threads) {
+  if (threads > n / PSORT_MIN_PER_THREAD)
+    threads = n / PSORT_MIN_PER_THREAD;
+  if (workpool_worker() != SIZE_MAX)
+    threads = 1;
+  if (threads > 1) {
+    size_t workers = workpool_start(threads);
+    if (workers < threads)
+      threads = workers;
+  }
+  char *tmp = threads > 1 ? malloc(n * size) : NULL;
+  size_t *bounds = tmp ? malloc((threads + 1) * sizeof(*bounds)) : NULL;
+  if (bounds == NULL) {
+    free(tmp);
+    qsort(base, n, size, cmp);
+    return;
+  }
+
+  for (size_t i = 0; i <= threads; i++)
+    bounds[i] = n * i / threads;
+  struct psort_job job = {base, tmp, size, cmp, bounds, threads, 1};
+  int failed = workpool_run_on(threads, psort_run_task, &job, threads) != 0;
+  while (!failed && job.runs > 1) {
+    size_t pairs = (job.runs + 1) / 2;
+    job.slices = (threads * PSORT_SLICES_PER_THREAD + pairs - 1) / pairs;
+    if (workpool_run_on(threads, psort_merge_task, &job,
+                        pairs * job.slices) != 0) {
+      failed = 1;
+      break;
+    }
+    for (size_t i = 0; i < pairs; i++)
+      bounds[i] = bounds[i * 2];
+    bounds[pairs] = n;
+    job.runs = pairs;
+    char *swap = job.src;
+    job.src = job.dst;
+    job.dst = swap;
+  }
+  // workpool_run_on fails before running anything, so src still holds every
+  // element, sorted or not.
+  if (failed)
+    qsort(job.src, n, size, cmp);
+  if (job.src != base)
+    memcpy(base, job.src, n * size);
+  free(tmp);
+  free(bounds);
+}
+
+#endif
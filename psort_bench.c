@@ -0,0 +1,109 @@
+// Scaling benchmark for psort.h: checks the result against qsort, then times
+// sorting random 64-bit integers and short-string records (the shape of the
+// pairs mapreduce.c sorts) with 1, 2, 4, ... threads up to every core.
+#define _POSIX_C_SOURCE 200809L
+#include "psort.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+struct record {
+  const char *key;
+  const char *value;
+};
+
+static double now_sec(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint64_t rng_state = 88172645463325252ull;
+
+static uint64_t rng(void) {
+  rng_state ^= rng_state << 13;
+  rng_state ^= rng_state >> 7;
+  rng_state ^= rng_state << 17;
+  return rng_state;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
+
+static int cmp_record(const void *a, const void *b) {
+  return strcmp(((const struct record *)a)->key,
+                ((const struct record *)b)->key);
+}
+
+static void bench(const char *name, const void *data, size_t n, size_t size,
+                  int (*cmp)(const void *, const void *), size_t max_threads) {
+  void *ref = malloc(n * size), *work = malloc(n * size);
+  memcpy(ref, data, n * size);
+  double start = now_sec();
+  qsort(ref, n, size, cmp);
+  double qsort_sec = now_sec() - start;
+
+  printf("\n%s, %zu elements\n", name, n);
+  printf("%-8s %10s %10s\n", "threads", "seconds", "speedup");
+  printf("%-8s %10.3f %10s\n", "qsort", qsort_sec, "1.00");
+  for (size_t t = 1;; t *= 2) {
+    if (t > max_threads)
+      t = max_threads;
+    memcpy(work, data, n * size);
+    start = now_sec();
+    psort(work, n, size, cmp, t);
+    double sec = now_sec() - start;
+    // Records with equal keys may land in any order, so compare by key.
+    int ok = 1;
+    for (size_t i = 0; ok && i < n; i++)
+      ok = cmp((char *)work + i * size, (char *)ref + i * size) == 0;
+    printf("%-8zu %10.3f %10.2f%s\n", t, sec, qsort_sec / sec,
+           ok ? "" : "  MISMATCH");
+    if (!ok)
+      exit(1);
+    if (t >= max_threads)
+      break;
+  }
+  free(ref);
+  free(work);
+}
+
+int main(int argc, char *argv[]) {
+  size_t n = argc > 1 ? strtoull(argv[1], NULL, 10) : 4000000;
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+  size_t max_threads = argc > 2 ? strtoull(argv[2], NULL, 10)
+                                : (size_t)(cores > 0 ? cores : 1);
+  if (max_threads > WORKPOOL_MAX_WORKERS)
+    max_threads = WORKPOOL_MAX_WORKERS;
+
+  uint64_t *nums = malloc(n * sizeof(*nums));
+  for (size_t i = 0; i < n; i++)
+    nums[i] = rng();
+  bench("random u64", nums, n, sizeof(*nums), cmp_u64, max_threads);
+  free(nums);
+
+  // Word-like keys from a vocabulary of n / 16, so keys repeat as they do in
+  // an intermediate buffer.
+  size_t vocab = n / 16 ? n / 16 : 1;
+  char *words = malloc(vocab * 16);
+  for (size_t i = 0; i < vocab; i++) {
+    int len = 3 + rng() % 10;
+    for (int k = 0; k < len; k++)
+      words[i * 16 + k] = 'a' + rng() % 26;
+    words[i * 16 + len] = '\0';
+  }
+  struct record *recs = malloc(n * sizeof(*recs));
+  for (size_t i = 0; i < n; i++) {
+    recs[i].key = words + rng() % vocab * 16;
+    recs[i].value = "1";
+  }
+  bench("string records", recs, n, sizeof(*recs), cmp_record, max_threads);
+  free(recs);
+  free(words);
+  return 0;
+}
@@ -1,6 +1,9 @@
 #define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE
 #include <arpa/inet.h>
+#include <endian.h>
 #include <netinet/in.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -11,14 +14,142 @@
 #define MAX_CLIENTS 100
 #define SHUTDOWN_WAIT_TIMEOUT_SEC 10
 
+// Every broadcast frame gets a sequence number and is kept in a ring, so
+// multicast clients that miss a datagram can NACK it over TCP and reconnecting
+// clients can resume from the last frame they saw. Only multicast clients and
+// those that sent a hello get announces; everyone else sees the plain type 0 /
+// type 1 stream.
+#define MAX_FRAME_SIZE 1024
+#define RETRANSMIT_WINDOW 4096
+#define MSG_NACK 2        // client -> server: [2][first seq u64][count u32]
+#define MSG_RETRANSMIT 3  // server -> client: [3][seq u64][type 0 frame]
+#define MSG_ANNOUNCE 4    // server -> client: [4][group ip][port][next seq]
+#define MSG_GAP 5         // server -> client: [5][first seq u64][count u32]
+#define MSG_RESUME 6      // client -> server: [6][first missed seq u64]
+#define MSG_HELLO 7       // client -> server: [7], asks for announces
+
+static struct {
+  uint64_t seq;
+  size_t len;
+  uint8_t data[MAX_FRAME_SIZE];
+} history[RETRANSMIT_WINDOW];
+static uint64_t next_seq = 0;
+// Frames are only copied into the ring once someone can ask for them again;
+// plain unicast fanout just counts them.
+static int keep_history = 0;
+static uint64_t history_start = 0; // first frame kept
+
+static int parse_addr_port(const char *str, struct sockaddr_in *addr) {
+  char host[INET_ADDRSTRLEN];
+  const char *colon = strrchr(str, ':');
+  if (!colon || colon == str || (size_t)(colon - str) >= sizeof(host))
+    return -1;
+  memcpy(host, str, colon - str);
+  host[colon - str] = '\0';
+  memset(addr, 0, sizeof(*addr));
+  addr->sin_family = AF_INET;
+  addr->sin_port = htons(atoi(colon + 1));
+  if (inet_pton(AF_INET, host, &addr->sin_addr) <= 0)
+    return -1;
+  return 0;
+}
+
+static void start_history(void) {
+  if (!keep_history) {
+    keep_history = 1;
+    history_start = next_seq;
+  }
+}
+
+static uint64_t record_frame(const uint8_t *frame, size_t len) {
+  uint64_t seq = next_seq++;
+  if (!keep_history)
+    return seq;
+  size_t slot = seq % RETRANSMIT_WINDOW;
+  history[slot].seq = seq;
+  history[slot].len = len;
+  memcpy(history[slot].data, frame, len);
+  return seq;
+}
+
+// Without multicast the group is all zeros and the announce only tells the
+// client where the sequence numbers of its TCP stream start.
+static void send_announce(int sd, const struct sockaddr_in *group) {
+  uint8_t msg[1 + 4 + 2 + 8];
+  uint64_t seq_be = htobe64(next_seq);
+  msg[0] = MSG_ANNOUNCE;
+  memset(msg + 1, 0, 6);
+  if (group) {
+    memcpy(msg + 1, &group->sin_addr.s_addr, 4);
+    memcpy(msg + 5, &group->sin_port, 2);
+  }
+  memcpy(msg + 7, &seq_be, 8);
+  if (write(sd, msg, sizeof(msg)) != (ssize_t)sizeof(msg))
+    perror("write announce");
+}
+
+static void send_retransmits(int sd, uint64_t first, uint32_t count) {
+  uint64_t oldest = next_seq > RETRANSMIT_WINDOW ? next_seq - RETRANSMIT_WINDOW
+                                                 : 0;
+  if (!keep_history)
+    oldest = next_seq;
+  else if (oldest < history_start)
+    oldest = history_start;
+  uint64_t end = first + count;
+  if (end > next_seq)
+    end = next_seq;
+  if (first < oldest) {
+    uint64_t lost_end = end < oldest ? end : oldest;
+    uint8_t gap[1 + 8 + 4];
+    uint64_t first_be = htobe64(first);
+    uint32_t count_be = htonl((uint32_t)(lost_end - first));
+    gap[0] = MSG_GAP;
+    memcpy(gap + 1, &first_be, 8);
+    memcpy(gap + 9, &count_be, 4);
+    if (write(sd, gap, sizeof(gap)) != (ssize_t)sizeof(gap))
+      perror("write gap");
+    first = lost_end;
+  }
+  for (uint64_t seq = first; seq < end; seq++) {
+    size_t slot = seq % RETRANSMIT_WINDOW;
+    uint8_t out[1 + 8 + MAX_FRAME_SIZE];
+    uint64_t seq_be = htobe64(seq);
+    out[0] = MSG_RETRANSMIT;
+    memcpy(out + 1, &seq_be, 8);
+    memcpy(out + 9, history[slot].data, history[slot].len);
+    size_t out_len = 9 + history[slot].len;
+    if (write(sd, out, out_len) != (ssize_t)out_len)
+      perror("write retransmit");
+  }
+}
+
 int main(int argc, char *argv[]) {
-  if (argc != 3) {
-    fprintf(stderr, "Usage: %s <port number> <# of clients>\n", argv[0]);
+  const char *mcast_spec = NULL;
+  const char *mcast_iface = "127.0.0.1";
+  int c;
+  while ((c = getopt(argc, argv, "m:i:")) != -1) {
+    switch (c) {
+    case 'm':
+      mcast_spec = optarg;
+      break;
+    case 'i':
+      mcast_iface = optarg;
+      break;
+    default:
+      goto usage;
+    }
+  }
+  if (argc - optind != 2) {
+  usage:
+    fprintf(stderr,
+            "Usage: %s [-m <group ip>:<port> [-i <interface ip>]] <port "
+            "number> <# of clients>\n",
+            argv[0]);
     exit(EXIT_FAILURE);
   }
 
-  int port = atoi(argv[1]);
-  int max_clients = atoi(argv[2]);
+  int port = atoi(argv[optind]);
+  int max_clients = atoi(argv[optind + 1]);
   if (max_clients > MAX_CLIENTS)
     max_clients = MAX_CLIENTS;
 
@@ -29,6 +160,8 @@ int main(int argc, char *argv[]) {
   fd_set readfds;
 
   int client_finished[MAX_CLIENTS] = {0};
+  uint64_t client_start_seq[MAX_CLIENTS] = {0}; // first frame sent live
+  int client_sequenced[MAX_CLIENTS] = {0};      // gets announces
   int total_connected_clients = 0;
   server_fd = socket(AF_INET, SOCK_STREAM, 0);
   if (server_fd < 0) {
@@ -59,6 +192,38 @@ int main(int argc, char *argv[]) {
 
   printf("Server is listening on port %d\n", port);
 
+  int mcast_fd = -1;
+  struct sockaddr_in mcast_addr;
+  if (mcast_spec) {
+    struct in_addr iface;
+    if (parse_addr_port(mcast_spec, &mcast_addr) < 0 ||
+        !IN_MULTICAST(ntohl(mcast_addr.sin_addr.s_addr))) {
+      fprintf(stderr, "invalid multicast group: %s\n", mcast_spec);
+      exit(EXIT_FAILURE);
+    }
+    if (inet_pton(AF_INET, mcast_iface, &iface) <= 0) {
+      fprintf(stderr, "invalid interface address: %s\n", mcast_iface);
+      exit(EXIT_FAILURE);
+    }
+    mcast_fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (mcast_fd < 0) {
+      perror("multicast socket");
+      exit(EXIT_FAILURE);
+    }
+    unsigned char loop = 1, ttl = 1;
+    if (setsockopt(mcast_fd, IPPROTO_IP, IP_MULTICAST_IF, &iface,
+                   sizeof(iface)) < 0 ||
+        setsockopt(mcast_fd, IPPROTO_IP, IP_MULTICAST_LOOP, &loop,
+                   sizeof(loop)) < 0 ||
+        setsockopt(mcast_fd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl,
+                   sizeof(ttl)) < 0) {
+      perror("multicast setsockopt");
+      exit(EXIT_FAILURE);
+    }
+    printf("Multicast fanout to %s via %s\n", mcast_spec, mcast_iface);
+    start_history();
+  }
+
   char leftover[MAX_CLIENTS][1024] = {{0}};
   int leftover_len[MAX_CLIENTS] = {0};
 
@@ -100,6 +265,10 @@ int main(int argc, char *argv[]) {
           total_connected_clients++;
           printf("Client added to slot %d, total: %d\n", i,
                  total_connected_clients);
+          client_start_seq[i] = next_seq;
+          client_sequenced[i] = mcast_fd >= 0;
+          if (client_sequenced[i])
+            send_announce(new_socket, &mcast_addr);
           break;
         }
       }
@@ -171,6 +340,21 @@ int main(int argc, char *argv[]) {
             memcpy(out_buffer + out_len, recvbuf + start + 1, msg_data_len);
             out_len += msg_data_len;
 
+            uint64_t seq = record_frame(out_buffer, out_len);
+            if (mcast_fd >= 0) {
+              uint8_t dgram[8 + sizeof(out_buffer)];
+              uint64_t seq_be = htobe64(seq);
+              memcpy(dgram, &seq_be, 8);
+              memcpy(dgram + 8, out_buffer, out_len);
+              if (sendto(mcast_fd, dgram, 8 + out_len, 0,
+                         (struct sockaddr *)&mcast_addr,
+                         sizeof(mcast_addr)) < 0) {
+                perror("sendto multicast");
+              }
+              start = end + 1;
+              continue;
+            }
+
             for (int j = 0; j < max_clients; j++) {
               int cli_sd = client_sockets[j];
               if (cli_sd > 0) {
@@ -181,6 +365,41 @@ int main(int argc, char *argv[]) {
               }
             }
             start = end + 1;
+          } else if (msg_type == MSG_NACK) {
+            if (rcvlen - start < 13)
+              break;
+            uint64_t first_be;
+            uint32_t count_be;
+            memcpy(&first_be, recvbuf + start + 1, 8);
+            memcpy(&count_be, recvbuf + start + 9, 4);
+            send_retransmits(sd, be64toh(first_be), ntohl(count_be));
+            start += 13;
+          } else if (msg_type == MSG_RESUME) {
+            // A reconnected client: replay what it missed up to where this
+            // connection's live stream began.
+            if (rcvlen - start < 9)
+              break;
+            uint64_t first_be;
+            memcpy(&first_be, recvbuf + start + 1, 8);
+            uint64_t first = be64toh(first_be);
+            if (first < client_start_seq[i]) {
+              uint64_t missed = client_start_seq[i] - first;
+              printf("Client %d resumes at %llu, replaying %llu frames\n", i,
+                     (unsigned long long)first, (unsigned long long)missed);
+              send_retransmits(sd, first,
+                               missed > UINT32_MAX ? UINT32_MAX
+                                                   : (uint32_t)missed);
+            }
+            start += 9;
+          } else if (msg_type == MSG_HELLO) {
+            // From here on the client can resume, so frames must be kept.
+            if (!client_sequenced[i]) {
+              start_history();
+              client_sequenced[i] = 1;
+              client_start_seq[i] = next_seq;
+              send_announce(sd, NULL);
+            }
+            start += 1;
           } else if (msg_type == 1) {
             client_finished[i] = 1;
             printf("Client %d sent type 1\n", i);
@@ -213,6 +432,11 @@ int main(int argc, char *argv[]) {
               uint8_t type1_msg[2] = {1, '\n'};
               for (int k = 0; k < max_clients; k++) {
                 if (client_sockets[k] > 0) {
+                  // Tell clients where the stream ends so they can NACK any
+                  // tail they missed before exiting.
+                  if (client_sequenced[k])
+                    send_announce(client_sockets[k],
+                                  mcast_fd >= 0 ? &mcast_addr : NULL);
                   ssize_t w = write(client_sockets[k], &type1_msg, 2);
                   printf("sent type 1 to client %d (socket %d), write "
                          "returned: %zd\n",
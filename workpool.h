@@ -0,0 +1,193 @@
+// Persistent work-stealing thread pool.
+//
+// Workers are started on first use and live for the rest of the process, so
+// repeated jobs do not pay for thread creation. Each worker owns a deque: it
+// pops its own tasks newest first and, once that runs dry, steals the oldest
+// task from another worker, which keeps every core busy when task costs are
+// uneven. workpool_run_on() is meant for one submitter at a time and must not
+// be called from inside a task.
+#ifndef WORKPOOL_H
+#define WORKPOOL_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#define WORKPOOL_MAX_WORKERS 64
+
+struct workpool_task {
+  void (*fn)(void *arg, size_t idx);
+  void *arg;
+  size_t idx;
+};
+
+// Ring indexed by ever-increasing top (steal end) and bottom (owner end).
+struct workpool_deque {
+  pthread_mutex_t lock;
+  struct workpool_task *tasks;
+  size_t cap;
+  size_t top;
+  size_t bottom;
+};
+
+static struct {
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  pthread_cond_t done;
+  struct workpool_deque *deques[WORKPOOL_MAX_WORKERS];
+  size_t n;
+  size_t active; // workers taking part in the current run
+  long queued;
+  size_t pending;
+} workpool = {.lock = PTHREAD_MUTEX_INITIALIZER,
+              .wake = PTHREAD_COND_INITIALIZER,
+              .done = PTHREAD_COND_INITIALIZER};
+
+static __thread size_t workpool_self = SIZE_MAX;
+
+// Index of the worker running the calling task, SIZE_MAX off the pool.
+static inline size_t workpool_worker(void) { return workpool_self; }
+
+static inline size_t workpool_size(void) {
+  return __atomic_load_n(&workpool.n, __ATOMIC_ACQUIRE);
+}
+
+// Makes room for `extra` more tasks so the pushes that follow cannot fail.
+static int workpool_reserve(struct workpool_deque *dq, size_t extra) {
+  pthread_mutex_lock(&dq->lock);
+  size_t count = dq->bottom - dq->top;
+  if (count + extra > dq->cap) {
+    size_t cap = dq->cap ? dq->cap : 64;
+    while (cap < count + extra)
+      cap *= 2;
+    struct workpool_task *tasks = malloc(cap * sizeof(*tasks));
+    if (tasks == NULL) {
+      pthread_mutex_unlock(&dq->lock);
+      return -1;
+    }
+    for (size_t i = dq->top; i < dq->bottom; i++)
+      tasks[i - dq->top] = dq->tasks[i % dq->cap];
+    free(dq->tasks);
+    dq->tasks = tasks;
+    dq->top = 0;
+    dq->bottom = count;
+    dq->cap = cap;
+  }
+  pthread_mutex_unlock(&dq->lock);
+  return 0;
+}
+
+static void workpool_push(struct workpool_deque *dq, struct workpool_task t) {
+  pthread_mutex_lock(&dq->lock);
+  dq->tasks[dq->bottom++ % dq->cap] = t;
+  pthread_mutex_unlock(&dq->lock);
+}
+
+static int workpool_take(struct workpool_deque *dq, int steal,
+                         struct workpool_task *t) {
+  pthread_mutex_lock(&dq->lock);
+  int found = dq->bottom != dq->top;
+  if (found)
+    *t = steal ? dq->tasks[dq->top++ % dq->cap]
+               : dq->tasks[--dq->bottom % dq->cap];
+  pthread_mutex_unlock(&dq->lock);
+  return found;
+}
+
+static int workpool_next(size_t self, struct workpool_task *t) {
+  size_t n = __atomic_load_n(&workpool.active, __ATOMIC_SEQ_CST);
+  if (self >= n)
+    return 0;
+  if (workpool_take(workpool.deques[self], 0, t))
+    return 1;
+  for (size_t i = 1; i < n; i++) {
+    if (workpool_take(workpool.deques[(self + i) % n], 1, t))
+      return 1;
+  }
+  return 0;
+}
+
+static void *workpool_main(void *arg) {
+  size_t self = (size_t)(uintptr_t)arg;
+  workpool_self = self;
+  for (;;) {
+    struct workpool_task t;
+    if (workpool_next(self, &t)) {
+      __atomic_sub_fetch(&workpool.queued, 1, __ATOMIC_SEQ_CST);
+      t.fn(t.arg, t.idx);
+      if (__atomic_sub_fetch(&workpool.pending, 1, __ATOMIC_SEQ_CST) == 0) {
+        pthread_mutex_lock(&workpool.lock);
+        pthread_cond_broadcast(&workpool.done);
+        pthread_mutex_unlock(&workpool.lock);
+      }
+      continue;
+    }
+    pthread_mutex_lock(&workpool.lock);
+    while (__atomic_load_n(&workpool.queued, __ATOMIC_SEQ_CST) <= 0 ||
+           self >= __atomic_load_n(&workpool.active, __ATOMIC_SEQ_CST))
+      pthread_cond_wait(&workpool.wake, &workpool.lock);
+    pthread_mutex_unlock(&workpool.lock);
+  }
+  return NULL;
+}
+
+// Grows the pool to at least n workers (capped at WORKPOOL_MAX_WORKERS) and
+// returns its size, which may be larger if an earlier caller asked for more.
+static size_t workpool_start(size_t n) {
+  if (n > WORKPOOL_MAX_WORKERS)
+    n = WORKPOOL_MAX_WORKERS;
+  pthread_mutex_lock(&workpool.lock);
+  while (workpool.n < n) {
+    struct workpool_deque *dq = calloc(1, sizeof(*dq));
+    if (dq == NULL)
+      break;
+    pthread_mutex_init(&dq->lock, NULL);
+    workpool.deques[workpool.n] = dq;
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, workpool_main,
+                       (void *)(uintptr_t)workpool.n) != 0) {
+      workpool.deques[workpool.n] = NULL;
+      free(dq);
+      break;
+    }
+    pthread_detach(tid);
+    __atomic_store_n(&workpool.n, workpool.n + 1, __ATOMIC_RELEASE);
+  }
+  size_t size = workpool.n;
+  pthread_mutex_unlock(&workpool.lock);
+  return size;
+}
+
+// Runs fn(arg, 0..n-1) on the first `workers` workers of the pool (all of
+// them if there are fewer) and returns once all of them finished, or -1
+// without running anything if the pool has no workers or no memory. Tasks
+// are dealt out in contiguous blocks so neighbouring indices start on the
+// same worker; stealing evens things out from there.
+static int workpool_run_on(size_t workers, void (*fn)(void *, size_t),
+                           void *arg, size_t n) {
+  if (workers > workpool_size())
+    workers = workpool_size();
+  if (n == 0)
+    return 0;
+  if (workers == 0)
+    return -1;
+  for (size_t w = 0; w < workers; w++) {
+    if (workpool_reserve(workpool.deques[w], n / workers + 1) != 0)
+      return -1;
+  }
+  __atomic_store_n(&workpool.pending, n, __ATOMIC_SEQ_CST);
+  __atomic_store_n(&workpool.active, workers, __ATOMIC_SEQ_CST);
+  for (size_t i = 0; i < n; i++) {
+    struct workpool_task t = {fn, arg, i};
+    workpool_push(workpool.deques[i * workers / n], t);
+  }
+  pthread_mutex_lock(&workpool.lock);
+  __atomic_add_fetch(&workpool.queued, (long)n, __ATOMIC_SEQ_CST);
+  pthread_cond_broadcast(&workpool.wake);
+  while (__atomic_load_n(&workpool.pending, __ATOMIC_SEQ_CST) > 0)
+    pthread_cond_wait(&workpool.done, &workpool.lock);
+  pthread_mutex_unlock(&workpool.lock);
+  return 0;
+}
+
+#endif